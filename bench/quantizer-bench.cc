@@ -0,0 +1,333 @@
+/* Copyright © 2026 Jakub Wilk <jwilk@jwilk.net>
+ *
+ * This file is part of pdf2djvu.
+ *
+ * pdf2djvu is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * pdf2djvu is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+/* Micro-benchmark for the foreground quantizers.
+ *
+ * Quantizers are fed synthetic foreground/background pairs, without
+ * rendering anything, so this doesn't need any PDF files.
+ * Every quantizer runs single-threaded, and then (if built with OpenMP)
+ * with as many threads as OMP_NUM_THREADS allows.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <new>
+#include <ostream>
+#include <streambuf>
+#include <string>
+#include <vector>
+
+#if _OPENMP
+#include <omp.h>
+#endif
+
+#include "autoconf.hh"
+#include "config.hh"
+#include "image-filter.hh"
+#include "pixmap.hh"
+
+/* Allocation counting
+ * ===================
+ */
+
+static std::atomic<size_t> n_allocations(0);
+static std::atomic<size_t> n_allocated_bytes(0);
+
+/* These are not inlined, so that GCC doesn't match calls to operator new
+ * against free() calls, and complain about mismatched allocation functions.
+ */
+
+__attribute__((noinline)) void *operator new(size_t size)
+{
+    n_allocations++;
+    n_allocated_bytes += size;
+    void *ptr = std::malloc(size > 0 ? size : 1);
+    if (ptr == nullptr)
+        throw std::bad_alloc();
+    return ptr;
+}
+
+__attribute__((noinline)) void operator delete(void *ptr) noexcept
+{
+    std::free(ptr);
+}
+
+__attribute__((noinline)) void operator delete(void *ptr, size_t) noexcept
+{
+    std::free(ptr);
+}
+
+/* class NullBuffer
+ * ================
+ */
+
+/* Stream buffer that throws data away, counting bytes: */
+class NullBuffer : public std::streambuf
+{
+protected:
+    size_t size;
+    int overflow(int c)
+    {
+        this->size++;
+        return c;
+    }
+    std::streamsize xsputn(const char *s, std::streamsize n)
+    {
+        this->size += n;
+        return n;
+    }
+public:
+    NullBuffer()
+    : size(0)
+    { }
+    size_t get_size() const
+    {
+        return this->size;
+    }
+};
+
+/* class Image
+ * ===========
+ */
+
+class Image
+{
+protected:
+    std::vector<uint8_t> data;
+public:
+    const int width, height;
+    Image(int width, int height)
+    : data(3 * static_cast<size_t>(width) * height),
+      width(width),
+      height(height)
+    { }
+    uint8_t *get_row(int y)
+    {
+        return this->data.data() + 3 * static_cast<size_t>(this->width) * y;
+    }
+    void set(int x, int y, uint8_t r, uint8_t g, uint8_t b)
+    {
+        uint8_t *p = this->get_row(y) + 3 * x;
+        p[0] = r;
+        p[1] = g;
+        p[2] = b;
+    }
+    void fill(uint8_t r, uint8_t g, uint8_t b)
+    {
+        for (int y = 0; y < this->height; y++)
+        for (int x = 0; x < this->width; x++)
+            this->set(x, y, r, g, b);
+    }
+    const uint8_t *get_data() const
+    {
+        return this->data.data();
+    }
+};
+
+/* Deterministic pseudo-random numbers (32-bit LCG): */
+class Random
+{
+protected:
+    uint32_t state;
+public:
+    explicit Random(uint32_t seed)
+    : state(seed)
+    { }
+    uint32_t operator()(uint32_t n)
+    {
+        this->state = this->state * 1664525 + 1013904223;
+        return (this->state >> 8) % n;
+    }
+};
+
+/* Synthetic pages
+ * ===============
+ */
+
+enum class TextColor
+{
+    black,
+    gradient,
+};
+
+/* Draw lines of "words" made of vertical strokes, roughly like 10pt text: */
+static void draw_text(Image &image, int dpi, TextColor color, Random &random)
+{
+    const int line_height = dpi / 6;
+    const int x_height = dpi / 12;
+    const int margin = dpi;
+    for (int y0 = margin; y0 + line_height < image.height - margin; y0 += line_height)
+    {
+        int x0 = margin;
+        while (x0 < image.width - margin)
+        {
+            const int word_width = std::min(
+                static_cast<int>(dpi / 10 + random(dpi / 2)),
+                image.width - margin - x0
+            );
+            for (int y = y0; y < y0 + x_height; y++)
+            for (int x = x0; x < x0 + word_width; x++)
+            {
+                if ((x - x0) % 6 >= 2)
+                    continue;
+                if (color == TextColor::black)
+                    image.set(x, y, 0, 0, 0);
+                else
+                    image.set(x, y, y * 255 / image.height, 40, 255 - x * 255 / image.width);
+            }
+            x0 += word_width + dpi / 20;
+        }
+    }
+}
+
+static void make_sparse_text(Image &fg, Image &bg, int dpi)
+{
+    Random random(1);
+    bg.fill(0xFF, 0xFF, 0xFF);
+    fg.fill(0xFF, 0xFF, 0xFF);
+    draw_text(fg, dpi, TextColor::black, random);
+}
+
+static void make_dense_color(Image &fg, Image &bg, int dpi)
+{
+    Random random(2);
+    bg.fill(0xF0, 0xF0, 0xE0);
+    for (int y = 0; y < fg.height; y++)
+    for (int x = 0; x < fg.width; x++)
+    {
+        if (random(5) < 3)
+        {
+            uint32_t rgb = random(1 << 24);
+            fg.set(x, y, rgb >> 16, (rgb >> 8) & 0xFF, rgb & 0xFF);
+        }
+        else
+            fg.set(x, y, 0xF0, 0xF0, 0xE0);
+    }
+}
+
+static void make_gradients(Image &fg, Image &bg, int dpi)
+{
+    Random random(3);
+    for (int y = 0; y < bg.height; y++)
+    for (int x = 0; x < bg.width; x++)
+    {
+        uint8_t r = 0x80 + x * 0x7F / bg.width;
+        uint8_t g = 0x80 + y * 0x7F / bg.height;
+        bg.set(x, y, r, g, 0xC0);
+        fg.set(x, y, r, g, 0xC0);
+    }
+    draw_text(fg, dpi, TextColor::gradient, random);
+}
+
+class Workload
+{
+public:
+    const char *name;
+    double width_in, height_in;
+    int dpi;
+    void (*make)(Image &, Image &, int dpi);
+};
+
+static const Workload workloads[] = {
+    {"sparse-text", 8.27, 11.69, 300, make_sparse_text},
+    {"dense-color", 8.27, 11.69, 300, make_dense_color},
+    {"gradients", 8.27, 11.69, 300, make_gradients},
+    {"a0-sparse-text", 33.11, 46.81, 150, make_sparse_text},
+};
+
+/* Benchmark
+ * =========
+ */
+
+static void bench(const char *name, Quantizer &quantizer, const Workload &workload, const Image &fg_image, const Image &bg_image, int n_threads, int repeat)
+{
+    const int width = fg_image.width;
+    const int height = fg_image.height;
+    PixmapView fg(fg_image.get_data(), width, height, 3 * static_cast<size_t>(width));
+    PixmapView bg(bg_image.get_data(), width, height, 3 * static_cast<size_t>(width));
+    double best_time = 0;
+    size_t allocations = 0, allocated_bytes = 0, output_size = 0;
+    for (int i = 0; i < repeat; i++)
+    {
+        NullBuffer buffer;
+        std::ostream stream(&buffer);
+        int background_color[3] = {0xFF, 0xFF, 0xFF};
+        bool has_foreground = false;
+        bool has_background = false;
+        size_t allocations_before = n_allocations;
+        size_t allocated_bytes_before = n_allocated_bytes;
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        quantizer(fg, bg, background_color, has_foreground, has_background, stream, n_threads);
+        std::chrono::duration<double> time = std::chrono::steady_clock::now() - start;
+        allocations = n_allocations - allocations_before;
+        allocated_bytes = n_allocated_bytes - allocated_bytes_before;
+        output_size = buffer.get_size();
+        if (i == 0 || time.count() < best_time)
+            best_time = time.count();
+    }
+    double mpixels = 1.0 * width * height / 1e6;
+    std::printf("%-14s %-16s %5dx%-5d %7d %10.1f %10zu %12.1f %10.1f\n",
+        name, workload.name, width, height, n_threads,
+        mpixels / best_time,
+        allocations,
+        allocated_bytes / 1048576.0,
+        output_size / 1024.0
+    );
+    std::fflush(stdout);
+}
+
+int main(int argc, char **argv)
+{
+    int repeat = 3;
+    if (argc > 1)
+        repeat = std::max(1, std::atoi(argv[1]));
+    Config config;
+    std::vector<std::pair<const char *, std::unique_ptr<Quantizer>>> quantizers;
+    quantizers.emplace_back("default", std::unique_ptr<Quantizer>(new DefaultQuantizer(config)));
+    quantizers.emplace_back("web", std::unique_ptr<Quantizer>(new WebSafeQuantizer(config)));
+    quantizers.emplace_back("black", std::unique_ptr<Quantizer>(new MaskQuantizer(config)));
+#if HAVE_GRAPHICSMAGICK
+    Config gm_config;
+    gm_config.fg_colors = 64;
+    quantizers.emplace_back("graphicsmagick", std::unique_ptr<Quantizer>(new GraphicsMagickQuantizer(gm_config)));
+#endif
+    std::vector<int> thread_counts(1, 1);
+#if _OPENMP
+    if (omp_get_max_threads() > 1)
+        thread_counts.push_back(omp_get_max_threads());
+#endif
+    std::printf("%-14s %-16s %11s %7s %10s %10s %12s %10s\n",
+        "quantizer", "image", "size", "threads", "Mpixel/s", "allocs", "alloc (MiB)", "out (KiB)"
+    );
+    for (const Workload &workload : workloads)
+    {
+        int width = static_cast<int>(workload.width_in * workload.dpi);
+        int height = static_cast<int>(workload.height_in * workload.dpi);
+        Image fg(width, height);
+        Image bg(width, height);
+        workload.make(fg, bg, workload.dpi);
+        for (const auto &quantizer : quantizers)
+        for (int n_threads : thread_counts)
+            bench(quantizer.first, *quantizer.second, workload, fg, bg, n_threads, repeat);
+    }
+    return 0;
+}
+
+// vim:ts=4 sts=4 sw=4 et
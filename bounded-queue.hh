@@ -0,0 +1,95 @@
+/* Copyright © 2026 Jakub Wilk <jwilk@jwilk.net>
+ *
+ * This file is part of pdf2djvu.
+ *
+ * pdf2djvu is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * pdf2djvu is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+#ifndef PDF2DJVU_BOUNDED_QUEUE_HH
+#define PDF2DJVU_BOUNDED_QUEUE_HH
+
+#include <cassert>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <mutex>
+#include <utility>
+
+/* Multi-producer, multi-consumer queue of limited capacity.
+ * Producers block while the queue is full;
+ * consumers block while the queue is empty.
+ */
+template <typename T>
+class BoundedQueue
+{
+private:
+    BoundedQueue(const BoundedQueue &) = delete;
+    BoundedQueue& operator=(const BoundedQueue &) = delete;
+protected:
+    std::mutex mutex;
+    std::condition_variable not_empty;
+    std::condition_variable not_full;
+    std::deque<T> items;
+    size_t capacity;
+    size_t n_producers;
+public:
+    explicit BoundedQueue(size_t capacity)
+    : capacity(capacity),
+      n_producers(0)
+    {
+        assert(capacity > 0);
+    }
+
+    /* This must be called before any consumer starts waiting: */
+    void set_producers(size_t n)
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->n_producers = n;
+    }
+
+    void push(T item)
+    {
+        std::unique_lock<std::mutex> lock(this->mutex);
+        while (this->items.size() >= this->capacity)
+            this->not_full.wait(lock);
+        this->items.push_back(std::move(item));
+        this->not_empty.notify_one();
+    }
+
+    /* Every producer should call this once it's done: */
+    void close()
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        assert(this->n_producers > 0);
+        this->n_producers--;
+        if (this->n_producers == 0)
+            this->not_empty.notify_all();
+    }
+
+    /* Return false if the queue is empty, and all producers are done: */
+    bool pop(T &item)
+    {
+        std::unique_lock<std::mutex> lock(this->mutex);
+        while (this->items.empty())
+        {
+            if (this->n_producers == 0)
+                return false;
+            this->not_empty.wait(lock);
+        }
+        item = std::move(this->items.front());
+        this->items.pop_front();
+        this->not_full.notify_one();
+        return true;
+    }
+};
+
+#endif
+
+// vim:ts=4 sts=4 sw=4 et
@@ -49,6 +49,7 @@ Config::Config()
   this->preferred_page_size = {0, 0};
   this->use_media_box = false;
   this->bg_subsample = 3;
+  this->bg_rerender = false;
   this->fg_colors = this->FG_COLORS_DEFAULT;
   this->antialias = false;
   this->extract_metadata = true;
@@ -61,6 +62,8 @@ Config::Config()
   this->page_id_template.reset(default_page_id_template("p"));
   this->page_title_template.reset(new string_format::Template("{label}"));
   this->n_jobs = 1;
+  this->band_height = 0;
+  this->temp_memory = 256;
 }
 
 namespace string
@@ -195,6 +198,22 @@ static int parse_bg_subsample(const std::string &s)
   return n;
 }
 
+static int parse_band_height(const std::string &s)
+{
+  int n = string::as<int>(s);
+  if (n < 0)
+    throw Config::Error(_("The specified band height must be a non-negative integer"));
+  return n;
+}
+
+static int parse_temp_memory(const std::string &s)
+{
+  int n = string::as<int>(s);
+  if (n < 0)
+    throw Config::Error(_("The specified memory limit for temporary files must be a non-negative integer"));
+  return n;
+}
+
 static void validate_page_id_template(const string_format::Template &page_id_template)
 {
   string_format::Bindings bindings;
@@ -248,6 +267,8 @@ void Config::read_config(int argc, char * const argv[])
     OPT_VERBOSE = 'v',
     OPT_DUMMY = CHAR_MAX,
     OPT_ANTIALIAS,
+    OPT_BAND_HEIGHT,
+    OPT_BG_RERENDER,
     OPT_BG_SLICES,
     OPT_BG_SUBSAMPLE,
     OPT_FG_COLORS,
@@ -266,12 +287,15 @@ void Config::read_config(int argc, char * const argv[])
     OPT_PAGE_ID_TEMPLATE,
     OPT_PAGE_SIZE,
     OPT_PAGE_TITLE_TEMPLATE,
+    OPT_STATS,
+    OPT_TEMP_MEMORY,
     OPT_TEXT_CROP,
     OPT_TEXT_FILTER,
     OPT_TEXT_LINES,
     OPT_TEXT_NONE,
     OPT_TEXT_NO_NFKC,
     OPT_TEXT_WORDS,
+    OPT_TRACE,
     OPT_VERBATIM_METADATA,
     OPT_VERSION,
   };
@@ -279,6 +303,8 @@ void Config::read_config(int argc, char * const argv[])
   {
     { "anti-alias", 0, nullptr, OPT_ANTIALIAS },
     { "antialias", 0, nullptr, OPT_ANTIALIAS }, /* deprecated alias */
+    { "band-height", 1, nullptr, OPT_BAND_HEIGHT },
+    { "bg-rerender", 0, nullptr, OPT_BG_RERENDER },
     { "bg-slices", 1, nullptr, OPT_BG_SLICES },
     { "bg-subsample", 1, nullptr, OPT_BG_SUBSAMPLE },
     { "crop-text", 0, nullptr, OPT_TEXT_CROP },
@@ -312,6 +338,9 @@ void Config::read_config(int argc, char * const argv[])
     { "pageid-template", 1, nullptr, OPT_PAGE_ID_TEMPLATE }, /* deprecated alias */
     { "pages", 1, nullptr, OPT_PAGES },
     { "quiet", 0, nullptr, OPT_QUIET },
+    { "stats", 1, nullptr, OPT_STATS },
+    { "temp-memory", 1, nullptr, OPT_TEMP_MEMORY },
+    { "trace", 1, nullptr, OPT_TRACE },
     { "verbatim-metadata", 0, nullptr, OPT_VERBATIM_METADATA },
     { "verbose", 0, nullptr, OPT_VERBOSE },
     { "version", 0, nullptr, OPT_VERSION },
@@ -350,12 +379,18 @@ void Config::read_config(int argc, char * const argv[])
     case OPT_VERBOSE:
       this->verbose++;
       break;
+    case OPT_BAND_HEIGHT:
+      this->band_height = parse_band_height(optarg);
+      break;
     case OPT_BG_SLICES:
       this->bg_slices = optarg;
       break;
     case OPT_BG_SUBSAMPLE:
       this->bg_subsample = parse_bg_subsample(optarg);
       break;
+    case OPT_BG_RERENDER:
+      this->bg_rerender = true;
+      break;
     case OPT_FG_COLORS:
       this->fg_colors = parse_fg_colors(optarg);
       break;
@@ -487,6 +522,15 @@ void Config::read_config(int argc, char * const argv[])
     case OPT_JOBS:
       this->n_jobs = string::as<int>(optarg);
       break;
+    case OPT_STATS:
+      this->stats_file = optarg;
+      break;
+    case OPT_TEMP_MEMORY:
+      this->temp_memory = parse_temp_memory(optarg);
+      break;
+    case OPT_TRACE:
+      this->trace_file = optarg;
+      break;
     case OPT_HELP:
       throw NeedHelp();
     case OPT_VERSION:
@@ -536,6 +580,7 @@ static void print_usage(streamtp &stream)
     << std::endl <<   "     --bg-slices=N,...,N"
     << std::endl <<   "     --bg-slices=N+...+N"
     << std::endl <<   "     --bg-subsample=N"
+    << std::endl <<   "     --bg-rerender"
     << std::endl <<   "     --fg-colors=default"
     << std::endl <<   "     --fg-colors=web"
     << std::endl <<   "     --fg-colors=black"
@@ -563,6 +608,10 @@ static void print_usage(streamtp &stream)
 #if _OPENMP
     << std::endl <<   " -j, --jobs=N"
 #endif
+    << std::endl <<   "     --band-height=N"
+    << std::endl <<   "     --temp-memory=N"
+    << std::endl << _("     --stats=FILE")
+    << std::endl << _("     --trace=FILE")
     << std::endl <<   " -q, --quiet"
     << std::endl <<   " -h, --help"
     << std::endl <<   "     --version"
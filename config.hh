@@ -71,6 +71,7 @@ public:
   std::pair<int, int> preferred_page_size;
   bool use_media_box;
   int bg_subsample;
+  bool bg_rerender;
   int fg_colors;
   bool monochrome;
   int loss_level;
@@ -87,6 +88,10 @@ public:
   std::unique_ptr<string_format::Template> page_title_template;
   std::string text_filter_command_line;
   int n_jobs;
+  int band_height;
+  int temp_memory;
+  std::string stats_file;
+  std::string trace_file;
 
   Config();
 
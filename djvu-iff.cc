@@ -0,0 +1,186 @@
+/* Copyright © 2026 Jakub Wilk <jwilk@jwilk.net>
+ *
+ * This file is part of pdf2djvu.
+ *
+ * pdf2djvu is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * pdf2djvu is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+#include "djvu-iff.hh"
+
+#include <cassert>
+#include <iterator>
+#include <limits>
+#include <sstream>
+
+#include "i18n.hh"
+
+template <int nbits>
+static void print_int(std::ostream &stream, size_t value)
+{
+    assert(nbits % 8 == 0);
+    assert(nbits <= std::numeric_limits<size_t>::digits);
+    if (value >= static_cast<size_t>(1) << nbits)
+        throw djvu::iff::Error(_("IFF chunk too large"));
+    for (int i = (nbits / 8) - 1; i >= 0; i--)
+        stream << static_cast<char>((value >> (8 * i)) & 0xFF);
+}
+
+static size_t read_int32(const std::string &data, size_t offset)
+{
+    size_t value = 0;
+    for (size_t i = offset; i < offset + 4; i++)
+        value = (value << 8) | static_cast<unsigned char>(data[i]);
+    return value;
+}
+
+djvu::iff::Form::Form(std::istream &stream)
+{
+    std::string data(
+        (std::istreambuf_iterator<char>(stream)),
+        std::istreambuf_iterator<char>()
+    );
+    if (data.compare(0, 4, "AT&T") != 0)
+        throw djvu::iff::Error(_("Malformed IFF file"));
+    this->parse(data, 4);
+}
+
+void djvu::iff::Form::parse(const std::string &data, size_t offset)
+{
+    if (data.length() < offset + 12 || data.compare(offset, 4, "FORM") != 0)
+        throw djvu::iff::Error(_("Malformed IFF file"));
+    size_t end = offset + 8 + read_int32(data, offset + 4);
+    if (end > data.length())
+        throw djvu::iff::Error(_("Malformed IFF file"));
+    this->type = data.substr(offset + 8, 4);
+    offset += 12;
+    while (offset < end)
+    {
+        /* Chunks are aligned to even offsets: */
+        offset += offset & 1;
+        if (offset == end)
+            break;
+        if (offset + 8 > end)
+            throw djvu::iff::Error(_("Malformed IFF file"));
+        size_t length = read_int32(data, offset + 4);
+        if (length > end - offset - 8)
+            throw djvu::iff::Error(_("Malformed IFF file"));
+        this->chunks.push_back(djvu::iff::Chunk(
+            data.substr(offset, 4),
+            data.substr(offset + 8, length)
+        ));
+        offset += 8 + length;
+    }
+}
+
+void djvu::iff::Form::add(const std::string &id, const std::string &data)
+{
+    assert(id.length() == 4);
+    this->chunks.push_back(djvu::iff::Chunk(id, data));
+}
+
+void djvu::iff::Form::add(const djvu::iff::Form &source, const std::string &id)
+{
+    for (const djvu::iff::Chunk &chunk : source.chunks)
+        if (chunk.id == id)
+            this->chunks.push_back(chunk);
+}
+
+bool djvu::iff::Form::has(const std::string &id) const
+{
+    for (const djvu::iff::Chunk &chunk : this->chunks)
+        if (chunk.id == id)
+            return true;
+    return false;
+}
+
+size_t djvu::iff::Form::size() const
+{
+    size_t size = 12;
+    for (const djvu::iff::Chunk &chunk : this->chunks)
+    {
+        /* Chunks are aligned to even offsets: */
+        size += size & 1;
+        size += 8 + chunk.data.length();
+    }
+    return size;
+}
+
+void djvu::iff::Form::write(std::ostream &stream, size_t trailing_size) const
+{
+    stream << "FORM";
+    print_int<32>(stream, this->size() - 8 + trailing_size);
+    stream << this->type;
+    size_t size = 12;
+    for (const djvu::iff::Chunk &chunk : this->chunks)
+    {
+        if (size & 1)
+        {
+            stream.put('\0');
+            size++;
+        }
+        stream << chunk.id;
+        print_int<32>(stream, chunk.data.length());
+        stream << chunk.data;
+        size += 8 + chunk.data.length();
+    }
+}
+
+std::ostream &djvu::iff::operator<<(std::ostream &stream, const djvu::iff::Form &form)
+{
+    stream << "AT&T";
+    form.write(stream);
+    return stream;
+}
+
+void djvu::iff::append(std::iostream &stream, const std::string &id, const std::string &data)
+{
+    assert(id.length() == 4);
+    stream.seekp(0, std::ios::end);
+    std::streamoff size = stream.tellp();
+    if (size < 12)
+        throw djvu::iff::Error(_("Malformed IFF file"));
+    /* Chunks are aligned to even offsets: */
+    if (size & 1)
+    {
+        stream.put('\0');
+        size++;
+    }
+    stream << id;
+    print_int<32>(stream, data.length());
+    stream << data;
+    size += 8 + data.length();
+    stream.seekp(8, std::ios::beg);
+    print_int<32>(stream, size - 12);
+}
+
+std::string djvu::iff::info_chunk(int width, int height, int dpi)
+{
+    // DjVu Reference (§8.3.2):
+    // • INT16 (big-endian) width, height
+    // • BYTE minor version, major version
+    // • INT16 (little-endian) resolution
+    // • BYTE gamma (multiplied by 10)
+    // • BYTE flags (rotation)
+    static const int version = 26;
+    static const int gamma = 22;
+    static const int flags = 1;
+    if (width <= 0 || height <= 0 || width > 0xFFFF || height > 0xFFFF)
+        throw djvu::iff::Error(_("Invalid page size"));
+    assert(dpi > 0 && dpi <= 0xFFFF);
+    std::ostringstream stream;
+    print_int<16>(stream, width);
+    print_int<16>(stream, height);
+    stream << static_cast<char>(version) << static_cast<char>(0);
+    stream << static_cast<char>(dpi & 0xFF) << static_cast<char>(dpi >> 8);
+    stream << static_cast<char>(gamma) << static_cast<char>(flags);
+    return stream.str();
+}
+
+// vim:ts=4 sts=4 sw=4 et
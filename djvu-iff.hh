@@ -0,0 +1,100 @@
+/* Copyright © 2026 Jakub Wilk <jwilk@jwilk.net>
+ *
+ * This file is part of pdf2djvu.
+ *
+ * pdf2djvu is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * pdf2djvu is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+#ifndef PDF2DJVU_DJVU_IFF_H
+#define PDF2DJVU_DJVU_IFF_H
+
+#include <cstddef>
+#include <istream>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace djvu
+{
+
+    namespace iff
+    {
+
+        class Error
+        : public std::runtime_error
+        {
+        public:
+            explicit Error(const std::string &message)
+            : std::runtime_error(message)
+            { }
+        };
+
+        class Chunk
+        {
+        public:
+            Chunk(const std::string &id, const std::string &data)
+            : id(id),
+              data(data)
+            { }
+            std::string id;
+            std::string data;
+        };
+
+        class Form
+        {
+        public:
+            explicit Form(const std::string &type)
+            : type(type)
+            { }
+            /* Read a complete IFF file, including the “AT&T” magic: */
+            explicit Form(std::istream &stream);
+            const std::string& get_type() const
+            {
+                return this->type;
+            }
+            void add(const std::string &id, const std::string &data);
+            /* Copy all the chunks with the given id from another form: */
+            void add(const Form &source, const std::string &id);
+            bool has(const std::string &id) const;
+            const std::vector<Chunk>& get_chunks() const
+            {
+                return this->chunks;
+            }
+            /* Size of the whole FORM chunk, including its 8-byte header: */
+            size_t size() const;
+            /* Write the FORM chunk, without the “AT&T” magic.
+             * If trailing_size is non-zero, the caller is expected to write
+             * that many bytes of data (e.g. nested forms) right after it.
+             */
+            void write(std::ostream &stream, size_t trailing_size = 0) const;
+        private:
+            std::string type;
+            std::vector<Chunk> chunks;
+            void parse(const std::string &data, size_t offset);
+        };
+
+        /* Write a complete IFF file, including the “AT&T” magic: */
+        std::ostream &operator<<(std::ostream &, const Form &);
+
+        /* Append a chunk to a complete IFF file,
+         * updating the size of its top-level FORM chunk:
+         */
+        void append(std::iostream &stream, const std::string &id, const std::string &data);
+
+        std::string info_chunk(int width, int height, int dpi);
+
+    }
+
+}
+
+#endif
+
+// vim:ts=4 sts=4 sw=4 et
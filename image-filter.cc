@@ -14,18 +14,21 @@
 
 #include "image-filter.hh"
 
+#include <algorithm>
 #include <bitset>
 #include <cassert>
 #include <cstddef>
 #include <cstdint>
-#include <map>
+#include <cstring>
+#include <memory>
 #include <ostream>
+#include <sstream>
+#include <string>
 #include <vector>
 
 #include "autoconf.hh"
 #include "config.hh"
 #include "djvu-const.hh"
-#include "pdf-backend.hh"
 #include "rle.hh"
 
 #if HAVE_GRAPHICSMAGICK
@@ -58,106 +61,460 @@ static inline void write_uint32(std::ostream &stream, uint32_t item)
   stream.write(reinterpret_cast<char*>(buffer), 4);
 }
 
-void MaskQuantizer::operator()(pdf::Renderer *out_fg, pdf::Renderer *out_bg, int width, int height,
-  int *background_color, bool &has_foreground, bool &has_background, std::ostream &stream)
+/* Per-thread buffer for diff_row(): */
+static thread_local std::vector<uint8_t> row_mask;
+
+/* Range of pixels of a row, from begin to end - 1: */
+class PixelSpan
 {
-  if (out_fg == out_bg)
-  { /* Don't bother to analyze images if they are obviously identical. */
-    dummy_quantizer(width, height, background_color, stream);
+public:
+  int begin, end;
+};
+
+static inline uint64_t load_uint64(const uint8_t *p)
+{
+  uint64_t value;
+  std::memcpy(&value, p, sizeof value);
+  return value;
+}
+
+/* Return offset of the first byte that differs, or n if there's none: */
+static size_t first_difference(const uint8_t *a, const uint8_t *b, size_t n)
+{
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8)
+    if (load_uint64(a + i) != load_uint64(b + i))
+      break;
+  for (; i < n; i++)
+    if (a[i] != b[i])
+      break;
+  return i;
+}
+
+/* Return offset of the last byte that differs; there must be one: */
+static size_t last_difference(const uint8_t *a, const uint8_t *b, size_t n)
+{
+  size_t i = n;
+  for (; i >= 8; i -= 8)
+    if (load_uint64(a + i - 8) != load_uint64(b + i - 8))
+      break;
+  for (; i > 0; i--)
+    if (a[i - 1] != b[i - 1])
+      break;
+  assert(i > 0);
+  return i - 1;
+}
+
+/* Compare a row of the foreground with a row of the background.
+ * Return the span of pixels from the first to the last differing one;
+ * if the rows are identical, the span is empty, and both its ends are
+ * equal to width. Inside the span, set mask[x] to 1 where the pixels differ,
+ * and to 0 elsewhere; mask is not touched outside the span.
+ * Set has_foreground if any of the differing foreground pixels is not black.
+ * Set has_background if any background pixel is not background_color.
+ *
+ * On most pages, the foreground is sparse, so most rows are identical or
+ * differ only on a small part. These are found with memcmp() and word-sized
+ * comparisons. The other loops are plain passes over contiguous memory,
+ * without early exits, which are meant to be vectorized by the compiler.
+ */
+static PixelSpan diff_row(const uint8_t * __restrict__ fg, const uint8_t * __restrict__ bg, int width,
+  uint8_t * __restrict__ mask, const int *background_color, bool &has_foreground, bool &has_background)
+{
+  const size_t row_size = 3 * static_cast<size_t>(width);
+  PixelSpan span = {width, width};
+  if (std::memcmp(fg, bg, row_size) != 0)
+  {
+    span.begin = first_difference(fg, bg, row_size) / 3;
+    span.end = last_difference(fg, bg, row_size) / 3 + 1;
+  }
+  unsigned int fg_nonblack = 0;
+#if _OPENMP
+  #pragma omp simd reduction(|: fg_nonblack)
+#endif
+  for (int x = span.begin; x < span.end; x++)
+  {
+    const uint8_t *f = fg + 3 * x;
+    const uint8_t *b = bg + 3 * x;
+    const unsigned int diff = (f[0] ^ b[0]) | (f[1] ^ b[1]) | (f[2] ^ b[2]);
+    mask[x] = diff != 0;
+    fg_nonblack |= (diff != 0) & ((f[0] | f[1] | f[2]) != 0);
+  }
+  if (fg_nonblack)
+    has_foreground = true;
+  if (has_background)
+    return span;
+  const int r = background_color[0];
+  const int g = background_color[1];
+  const int b = background_color[2];
+  unsigned int bg_diff = 0;
+#if _OPENMP
+  #pragma omp simd reduction(|: bg_diff)
+#endif
+  for (int x = 0; x < width; x++)
+    bg_diff |= (bg[3 * x] != r) | (bg[3 * x + 1] != g) | (bg[3 * x + 2] != b);
+  if (bg_diff)
     has_background = true;
-    return;
+  return span;
+}
+
+/* class RowGroups
+ * ===============
+ */
+
+/* Rows of a band, split into groups that can be processed in parallel.
+ * Output of every group is buffered separately, and then copied to the real
+ * stream in order, so that the result doesn't depend on the number of
+ * threads. With only one group, output goes straight to the real stream.
+ */
+class RowGroups
+{
+public:
+  class Group
+  {
+  public:
+    int begin, end;
+    bool has_foreground, has_background;
+    std::ostringstream buffer;
+    std::ostream *stream;
+  };
+protected:
+  std::vector<Group> groups;
+public:
+  RowGroups(int height, int n_threads, bool has_foreground, bool has_background, std::ostream &stream)
+  /* Several groups per thread, so that threads don't wait for the one
+   * that got the most complex part of the page: */
+  : groups(n_threads > 1 ? std::min(height, 4 * n_threads) : 1)
+  {
+    const int n = this->groups.size();
+    for (int i = 0; i < n; i++)
+    {
+      Group &group = this->groups[i];
+      group.begin = static_cast<int64_t>(height) * i / n;
+      group.end = static_cast<int64_t>(height) * (i + 1) / n;
+      group.has_foreground = has_foreground;
+      group.has_background = has_background;
+      group.stream = n > 1 ? &group.buffer : &stream;
+    }
   }
-  rle::R4 r4(stream, width, height);
-  pdf::Pixmap bmp_fg(out_fg);
-  pdf::Pixmap bmp_bg(out_bg);
-  pdf::Pixmap::iterator p_fg = bmp_fg.begin();
-  pdf::Pixmap::iterator p_bg = bmp_bg.begin();
-  for (int y = 0; y < height; y++)
+
+  int size() const
   {
-    for (int x = 0; x < width; x++)
+    return this->groups.size();
+  }
+
+  Group &operator [](int i)
+  {
+    return this->groups[i];
+  }
+
+  /* Copy buffered output to the stream, and merge the flags: */
+  void join(bool &has_foreground, bool &has_background, std::ostream &stream)
+  {
+    for (Group &group : this->groups)
     {
-      if (!has_background)
+      if (group.stream != &stream)
       {
-        for (int i = 0; i < 3; i++)
-        if (background_color[i] != p_bg[i])
-        {
-          has_background = true;
-          break;
-        }
+        const std::string &data = group.buffer.str();
+        stream.write(data.data(), data.size());
+      }
+      has_foreground = has_foreground || group.has_foreground;
+      has_background = has_background || group.has_background;
+    }
+  }
+};
+
+/* class QuantizerSession : Quantizer::Session
+ * ===========================================
+ */
+
+/* State shared by sessions of all the built-in quantizers.
+ *
+ * When the foreground and the background of a band are the same object,
+ * the page has had nothing to render in the foreground so far. Such bands
+ * are only scanned for the background; their output, which doesn't depend
+ * on the pixels, is written only when the first band with a real foreground
+ * shows up. If there's none, the page is treated the way quantize_page()
+ * treats identical images.
+ */
+class QuantizerSession : public Quantizer::Session
+{
+protected:
+  const int width, height;
+  /* Number of rows added so far: */
+  int n_rows;
+  /* Whether any output has been written: */
+  bool started;
+  int *background_color;
+  bool &has_foreground, &has_background;
+  std::ostream &stream;
+  const int n_threads;
+
+  QuantizerSession(int width, int height,
+    int *background_color, bool &has_foreground, bool &has_background, std::ostream &stream, int n_threads)
+  : width(width), height(height),
+    n_rows(0),
+    started(false),
+    background_color(background_color),
+    has_foreground(has_foreground), has_background(has_background),
+    stream(stream),
+    n_threads(n_threads)
+  { }
+
+  void check_band(const PixmapView &bmp_fg, const PixmapView &bmp_bg) const
+  {
+    assert(bmp_fg.get_width() == this->width);
+    assert(bmp_bg.get_width() == this->width);
+    assert(bmp_fg.get_height() == bmp_bg.get_height());
+    assert(this->n_rows + bmp_fg.get_height() <= this->height);
+  }
+
+  /* Called with the first band of the page: */
+  virtual void start_page(const PixmapView &bmp_bg)
+  { }
+  virtual void write_header() = 0;
+  /* Output n rows in which the foreground is identical to the background: */
+  virtual void add_clean_rows(int n) = 0;
+  virtual void add_rows(const PixmapView &bmp_fg, const PixmapView &bmp_bg) = 0;
+  virtual void finish_rows()
+  { }
+
+public:
+  void add_band(const PixmapView &bmp_fg, const PixmapView &bmp_bg)
+  {
+    this->check_band(bmp_fg, bmp_bg);
+    if (this->n_rows == 0)
+      this->start_page(bmp_bg);
+    if (&bmp_fg == &bmp_bg && !this->started)
+    {
+      const int r = this->background_color[0];
+      const int g = this->background_color[1];
+      const int b = this->background_color[2];
+      for (int y = 0; y < bmp_bg.get_height() && !this->has_background; y++)
+      {
+        const uint8_t *p = bmp_bg.get_row(y);
+        for (int x = 0; x < this->width; x++, p += 3)
+          if (p[0] != r || p[1] != g || p[2] != b)
+          {
+            this->has_background = true;
+            break;
+          }
       }
-      if (p_fg[0] != p_bg[0] || p_fg[1] != p_bg[1] || p_fg[2] != p_bg[2])
+    }
+    else
+    {
+      if (!this->started)
       {
-        if (!has_foreground && (p_fg[0] || p_fg[1] || p_fg[2]))
-          has_foreground = true;
-        r4 << 1;
+        this->started = true;
+        this->write_header();
+        if (this->n_rows > 0)
+          this->add_clean_rows(this->n_rows);
       }
-      else
-        r4 << 0;
-      p_fg++;
-      p_bg++;
+      this->add_rows(bmp_fg, bmp_bg);
     }
-    p_fg.next_row();
-    p_bg.next_row();
+    this->n_rows += bmp_fg.get_height();
   }
 
-}
+  void finish()
+  {
+    assert(this->n_rows == this->height);
+    if (this->started)
+      this->finish_rows();
+    else
+    {
+      dummy_quantizer(this->width, this->height, this->background_color, this->stream);
+      this->has_background = true;
+    }
+  }
+};
 
-void WebSafeQuantizer::operator()(pdf::Renderer *out_fg, pdf::Renderer *out_bg, int width, int height,
-  int *background_color, bool &has_foreground, bool &has_background, std::ostream &stream)
+static void quantize_page(Quantizer &quantizer, const PixmapView &bmp_fg, const PixmapView &bmp_bg,
+  int *background_color, bool &has_foreground, bool &has_background, std::ostream &stream, int n_threads)
 {
-  if (out_fg == out_bg)
+  const int width = bmp_fg.get_width();
+  const int height = bmp_fg.get_height();
+  if (&bmp_fg == &bmp_bg)
   { /* Don't bother to analyze images if they are obviously identical. */
     dummy_quantizer(width, height, background_color, stream);
     has_background = true;
     return;
   }
-  stream << "R6 " << width << " " << height << " ";
-  output_web_palette(stream);
-  pdf::Pixmap bmp_fg(out_fg);
-  pdf::Pixmap bmp_bg(out_bg);
-  pdf::Pixmap::iterator p_fg = bmp_fg.begin();
-  pdf::Pixmap::iterator p_bg = bmp_bg.begin();
-  for (int i = 0; i < 3; i++)
-    background_color[i] = p_bg[i];
-  for (int y = 0; y < height; y++)
+  std::unique_ptr<Quantizer::Session> session = quantizer.start(
+    width, height,
+    background_color, has_foreground, has_background, stream, n_threads
+  );
+  assert(session);
+  session->add_band(bmp_fg, bmp_bg);
+  session->finish();
+}
+
+/* class MaskQuantizer
+ * ===================
+ */
+
+class MaskSession : public QuantizerSession
+{
+public:
+  MaskSession(int width, int height,
+    int *background_color, bool &has_foreground, bool &has_background, std::ostream &stream, int n_threads)
+  : QuantizerSession(width, height, background_color, has_foreground, has_background, stream, n_threads)
+  { }
+
+protected:
+  void write_header()
   {
-    int new_color, color = 0xFFF;
-    int length = 0;
-    for (int x = 0; x < width; x++)
+    rle::R4::write_header(this->stream, this->width, this->height);
+  }
+
+  void add_clean_rows(int n)
+  {
+    rle::R4 r4(this->stream, this->width, this->height, false);
+    for (int y = 0; y < n; y++)
+      r4.put(0, this->width);
+  }
+
+  void add_rows(const PixmapView &bmp_fg, const PixmapView &bmp_bg)
+  {
+    const int width = this->width;
+    RowGroups groups(bmp_fg.get_height(), this->n_threads, this->has_foreground, this->has_background, this->stream);
+#if _OPENMP
+    #pragma omp parallel for num_threads(this->n_threads) schedule(dynamic) if(groups.size() > 1)
+#endif
+    for (int i = 0; i < groups.size(); i++)
     {
-      if (!has_background)
+      RowGroups::Group &group = groups[i];
+      rle::R4 r4(*group.stream, width, this->height, false);
+      row_mask.resize(width);
+      uint8_t *mask = row_mask.data();
+      for (int y = group.begin; y < group.end; y++)
       {
-        for (int i = 0; i < 3; i++)
-        if (background_color[i] != p_bg[i])
-        {
-          has_background = true;
-          break;
-        }
+        const PixelSpan span = diff_row(bmp_fg.get_row(y), bmp_bg.get_row(y), width, mask,
+          this->background_color, group.has_foreground, group.has_background);
+        r4.put(0, span.begin);
+        for (int x = span.begin; x < span.end; x++)
+          r4 << mask[x];
+        r4.put(0, width - span.end);
       }
-      if (p_fg[0] != p_bg[0] || p_fg[1] != p_bg[1] || p_fg[2] != p_bg[2])
-      {
-        if (!has_foreground && (p_fg[0] || p_fg[1] || p_fg[2]))
-          has_foreground = true;
-        new_color = ((p_fg[2] + 1) / 43) + 6 * (((p_fg[1] + 1) / 43) + 6 * ((p_fg[0] + 1) / 43));
-      }
-      else
-        new_color = 0xFFF;
-      if (color == new_color)
-        length++;
-      else
+    }
+    groups.join(this->has_foreground, this->has_background, this->stream);
+  }
+};
+
+std::unique_ptr<Quantizer::Session> MaskQuantizer::start(int width, int height,
+  int *background_color, bool &has_foreground, bool &has_background, std::ostream &stream, int n_threads)
+{
+  return std::unique_ptr<Session>(new MaskSession(
+    width, height,
+    background_color, has_foreground, has_background, stream, n_threads
+  ));
+}
+
+void MaskQuantizer::operator()(const PixmapView &bmp_fg, const PixmapView &bmp_bg,
+  int *background_color, bool &has_foreground, bool &has_background, std::ostream &stream, int n_threads)
+{
+  quantize_page(*this, bmp_fg, bmp_bg, background_color, has_foreground, has_background, stream, n_threads);
+}
+
+/* class WebSafeQuantizer
+ * ======================
+ */
+
+class WebSafeSession : public QuantizerSession
+{
+public:
+  WebSafeSession(int width, int height,
+    int *background_color, bool &has_foreground, bool &has_background, std::ostream &stream, int n_threads)
+  : QuantizerSession(width, height, background_color, has_foreground, has_background, stream, n_threads)
+  { }
+
+protected:
+  void start_page(const PixmapView &bmp_bg)
+  {
+    const uint8_t *bg0 = bmp_bg.get_row(0);
+    for (int i = 0; i < 3; i++)
+      this->background_color[i] = bg0[i];
+  }
+
+  void write_header()
+  {
+    this->stream << "R6 " << this->width << " " << this->height << " ";
+    WebSafeQuantizer::output_web_palette(this->stream);
+  }
+
+  void add_clean_rows(int n)
+  {
+    for (int y = 0; y < n; y++)
+      write_uint32(this->stream, (static_cast<uint32_t>(0xFFF) << 20) + this->width);
+  }
+
+  void add_rows(const PixmapView &bmp_fg, const PixmapView &bmp_bg)
+  {
+    const int width = this->width;
+    RowGroups groups(bmp_fg.get_height(), this->n_threads, this->has_foreground, this->has_background, this->stream);
+#if _OPENMP
+    #pragma omp parallel for num_threads(this->n_threads) schedule(dynamic) if(groups.size() > 1)
+#endif
+    for (int i = 0; i < groups.size(); i++)
+    {
+      RowGroups::Group &group = groups[i];
+      std::ostream &group_stream = *group.stream;
+      row_mask.resize(width);
+      uint8_t *mask = row_mask.data();
+      for (int y = group.begin; y < group.end; y++)
       {
-        if (length > 0)
-          write_uint32(stream, (static_cast<uint32_t>(color) << 20) + length);
-        color = new_color;
-        length = 1;
+        const uint8_t *p_fg = bmp_fg.get_row(y);
+        const PixelSpan span = diff_row(p_fg, bmp_bg.get_row(y), width, mask,
+          this->background_color, group.has_foreground, group.has_background);
+        int new_color, color = 0xFFF;
+        int length = span.begin;
+        p_fg += 3 * span.begin;
+        for (int x = span.begin; x < span.end; x++, p_fg += 3)
+        {
+          if (mask[x])
+            new_color = ((p_fg[2] + 1) / 43) + 6 * (((p_fg[1] + 1) / 43) + 6 * ((p_fg[0] + 1) / 43));
+          else
+            new_color = 0xFFF;
+          if (color == new_color)
+            length++;
+          else
+          {
+            if (length > 0)
+              write_uint32(group_stream, (static_cast<uint32_t>(color) << 20) + length);
+            color = new_color;
+            length = 1;
+          }
+        }
+        if (span.end < width)
+        {
+          if (color == 0xFFF)
+            length += width - span.end;
+          else
+          {
+            write_uint32(group_stream, (static_cast<uint32_t>(color) << 20) + length);
+            color = 0xFFF;
+            length = width - span.end;
+          }
+        }
+        write_uint32(group_stream, (static_cast<uint32_t>(color) << 20) + length);
       }
-      p_fg++;
-      p_bg++;
     }
-    p_fg.next_row();
-    p_bg.next_row();
-    write_uint32(stream, (static_cast<uint32_t>(color) << 20) + length);
+    groups.join(this->has_foreground, this->has_background, this->stream);
   }
+};
+
+std::unique_ptr<Quantizer::Session> WebSafeQuantizer::start(int width, int height,
+  int *background_color, bool &has_foreground, bool &has_background, std::ostream &stream, int n_threads)
+{
+  return std::unique_ptr<Session>(new WebSafeSession(
+    width, height,
+    background_color, has_foreground, has_background, stream, n_threads
+  ));
+}
+
+void WebSafeQuantizer::operator()(const PixmapView &bmp_fg, const PixmapView &bmp_bg,
+  int *background_color, bool &has_foreground, bool &has_background, std::ostream &stream, int n_threads)
+{
+  quantize_page(*this, bmp_fg, bmp_bg, background_color, has_foreground, has_background, stream, n_threads);
 }
 
 class Rgb18
@@ -214,11 +571,36 @@ public:
 
 };
 
+/* Rgb18::reduce() maps each component separately, so it can be done with
+ * a small lookup table indexed by 6-bit component values:
+ */
+class Reduction
+{
+protected:
+  uint8_t table[1 << 6];
+public:
+  explicit Reduction(int k)
+  {
+    for (size_t i = 0; i < (1 << 6); i++)
+      table[i] = static_cast<int>(Rgb18(i).reduce(k)) & 0x3F;
+  }
+
+  Rgb18 operator ()(Rgb18 color) const
+  {
+    const int value = color;
+    return Rgb18(static_cast<size_t>(
+      table[value & 0x3F] |
+      (table[(value >> 6) & 0x3F] << 6) |
+      (table[value >> 12] << 12)
+    ));
+  }
+};
+
 class Run
 {
 protected:
   Rgb18 color;
-  size_t length;
+  uint32_t length;
 public:
   explicit Run(Rgb18 color)
   : color(color), length(0)
@@ -226,10 +608,17 @@ public:
   explicit Run()
   : color(Rgb18()), length(0)
   { }
+  explicit Run(Rgb18 color, uint32_t length)
+  : color(color), length(length)
+  { }
   void operator ++(int)
   {
     this->length++;
   }
+  void operator +=(uint32_t n)
+  {
+    this->length += n;
+  }
   bool same_color(Rgb18 other_color) const
   {
     return this->color == other_color;
@@ -238,157 +627,294 @@ public:
   {
     return this->color;
   }
-  size_t get_length() const
+  uint32_t get_length() const
   {
     return this->length;
   }
 };
 
-void DefaultQuantizer::operator()(pdf::Renderer *out_fg, pdf::Renderer *out_bg, int width, int height,
-  int *background_color, bool &has_foreground, bool &has_background, std::ostream &stream)
+/* Buffers used by DefaultQuantizer. They are kept between calls (one set per
+ * thread), so that quantizing a page doesn't allocate memory, except when
+ * the page is bigger or more complex than all the previous ones.
+ */
+class QuantizerWorkspace
 {
-  if (out_fg == out_bg)
-  { /* Don't bother to analyze images if they are obviously identical. */
-    dummy_quantizer(width, height, background_color, stream);
-    has_background = true;
-    return;
-  }
-  stream << "R6 " << width << " " << height << " ";
-  pdf::Pixmap bmp_fg(out_fg);
-  pdf::Pixmap bmp_bg(out_bg);
-  pdf::Pixmap::iterator p_fg = bmp_fg.begin();
-  pdf::Pixmap::iterator p_bg = bmp_bg.begin();
-  size_t color_counter = 0;
+public:
+  /* Runs of all rows of every row group of the page, one group after another: */
+  std::vector<std::vector<Run>> group_runs;
+  /* Row group i of the page ends just before row group_ends[i]: */
+  std::vector<int> group_ends;
+  /* Runs of row y start at group_runs[group][row_offsets[y]]; they end where
+   * the next row of the group starts, or at the end of group_runs[group]: */
+  std::vector<size_t> row_offsets;
+  /* Colors used in every row group of the current band, indexed by Rgb18: */
+  std::vector<std::bitset<1 << 18>> group_colors;
+  /* Distinct colors of the page; filled only if there are too many: */
+  std::vector<Rgb18> used_colors;
+  /* Color indices, indexed by Rgb18; only entries of used colors are valid: */
+  std::vector<uint16_t> color_map;
+  std::vector<uint16_t> quantized_color_map;
+  std::vector<unsigned char> output_buffer;
+  QuantizerWorkspace()
+  : color_map(1 << 18),
+    quantized_color_map(1 << 18)
+  { }
+};
+
+static thread_local QuantizerWorkspace quantizer_workspace;
+
+/* class DefaultQuantizer
+ * ======================
+ */
+
+/* Runs of all the bands are kept until the palette is known, so the session
+ * uses the workspace of the thread that started it, and only one session per
+ * thread may be active at a time.
+ */
+class DefaultSession : public QuantizerSession
+{
+protected:
+  QuantizerWorkspace &workspace;
   std::bitset<1 << 18> original_colors;
-  std::bitset<1 << 18> quantized_colors;
-  std::vector<std::vector<Run>> runs(height);
-  for (int i = 0; i < 3; i++)
-    background_color[i] = p_bg[i];
-  for (int y = 0; y < height; y++)
+public:
+  DefaultSession(int width, int height,
+    int *background_color, bool &has_foreground, bool &has_background, std::ostream &stream, int n_threads)
+  : QuantizerSession(width, height, background_color, has_foreground, has_background, stream, n_threads),
+    workspace(quantizer_workspace)
   {
-    Run run;
-    Rgb18 new_color;
-    for (int x = 0; x < width; x++)
+    this->workspace.group_ends.clear();
+    this->workspace.row_offsets.resize(height);
+  }
+
+protected:
+  void start_page(const PixmapView &bmp_bg)
+  {
+    const uint8_t *bg0 = bmp_bg.get_row(0);
+    for (int i = 0; i < 3; i++)
+      this->background_color[i] = bg0[i];
+  }
+
+  void write_header()
+  {
+    this->stream << "R6 " << this->width << " " << this->height << " ";
+  }
+
+  /* The clean rows are at the top of the page, so they make up the first
+   * row group: */
+  void add_clean_rows(int n)
+  {
+    QuantizerWorkspace &workspace = this->workspace;
+    assert(workspace.group_ends.empty());
+    if (workspace.group_runs.empty())
+      workspace.group_runs.resize(1);
+    std::vector<Run> &runs = workspace.group_runs[0];
+    runs.clear();
+    for (int y = 0; y < n; y++)
+    {
+      workspace.row_offsets[y] = runs.size();
+      runs.push_back(Run(Rgb18(), this->width));
+    }
+    workspace.group_ends.push_back(n);
+  }
+
+  void add_rows(const PixmapView &bmp_fg, const PixmapView &bmp_bg)
+  {
+    const int width = this->width;
+    const int y0 = this->n_rows;
+    QuantizerWorkspace &workspace = this->workspace;
+    std::vector<size_t> &row_offsets = workspace.row_offsets;
+    RowGroups groups(bmp_fg.get_height(), this->n_threads, this->has_foreground, this->has_background, this->stream);
+    std::vector<int> &group_ends = workspace.group_ends;
+    const size_t first_group = group_ends.size();
+    if (workspace.group_runs.size() < first_group + groups.size())
+      workspace.group_runs.resize(first_group + groups.size());
+    workspace.group_colors.resize(groups.size());
+#if _OPENMP
+    #pragma omp parallel for num_threads(this->n_threads) schedule(dynamic) if(groups.size() > 1)
+#endif
+    for (int i = 0; i < groups.size(); i++)
     {
-      if (!has_background)
+      RowGroups::Group &group = groups[i];
+      std::vector<Run> &runs = workspace.group_runs[first_group + i];
+      std::bitset<1 << 18> &colors = workspace.group_colors[i];
+      runs.clear();
+      colors.reset();
+      row_mask.resize(width);
+      uint8_t *mask = row_mask.data();
+      for (int y = group.begin; y < group.end; y++)
       {
-        for (int i = 0; i < 3; i++)
-        if (background_color[i] != p_bg[i])
+        row_offsets[y0 + y] = runs.size();
+        const uint8_t *p_fg = bmp_fg.get_row(y);
+        const PixelSpan span = diff_row(p_fg, bmp_bg.get_row(y), width, mask,
+          this->background_color, group.has_foreground, group.has_background);
+        Run run(Rgb18(), span.begin);
+        Rgb18 new_color;
+        p_fg += 3 * span.begin;
+        for (int x = span.begin; x < span.end; x++, p_fg += 3)
         {
-          has_background = true;
-          break;
+          if (mask[x])
+          {
+            new_color = Rgb18(p_fg[0], p_fg[1], p_fg[2]);
+            colors.set(new_color);
+          }
+          else
+            new_color = Rgb18();
+          if (run.same_color(new_color))
+            run++;
+          else
+          {
+            if (run.get_length() > 0)
+              runs.push_back(run);
+            run = Run(new_color);
+            run++;
+          }
         }
-      }
-      if (p_fg[0] != p_bg[0] || p_fg[1] != p_bg[1] || p_fg[2] != p_bg[2])
-      {
-        if (!has_foreground && (p_fg[0] || p_fg[1] || p_fg[2]))
-          has_foreground = true;
-        new_color = Rgb18(p_fg[0], p_fg[1], p_fg[2]);
-        if (!original_colors[new_color])
+        if (span.end < width)
         {
-          color_counter++;
-          original_colors.set(new_color);
+          if (run.same_color(Rgb18()))
+            run += width - span.end;
+          else
+          {
+            runs.push_back(run);
+            run = Run(Rgb18(), width - span.end);
+          }
         }
-      }
-      else
-        new_color = Rgb18();
-      if (run.same_color(new_color))
-        run++;
-      else
-      {
         if (run.get_length() > 0)
-          runs[y].push_back(run);
-        run = Run(new_color);
-        run++;
+          runs.push_back(run);
       }
-      p_fg++;
-      p_bg++;
     }
-    p_fg.next_row();
-    p_bg.next_row();
-    if (run.get_length() > 0)
-      runs[y].push_back(run);
-  }
-  /* Find appropriate color palette: */
-  int divisor = 4;
-  while (color_counter > djvu::max_fg_colors)
-  {
-    size_t new_color_counter = 0;
-    quantized_colors.reset();
-    divisor++;
-    for (size_t color = 0; color < original_colors.size(); color++)
+    groups.join(this->has_foreground, this->has_background, this->stream);
+    for (int i = 0; i < groups.size(); i++)
     {
-      if (!original_colors[color])
-        continue;
-      Rgb18 new_color = Rgb18(color).reduce(divisor);
-      if (!quantized_colors[new_color])
-      {
-        quantized_colors.set(new_color);
-        new_color_counter++;
-        if (new_color_counter > djvu::max_fg_colors)
-          break;
-      }
+      this->original_colors |= workspace.group_colors[i];
+      group_ends.push_back(y0 + groups[i].end);
     }
-    color_counter = new_color_counter;
   }
-  if (divisor == 4)
-    quantized_colors = original_colors;
-  /* Output the palette: */
-  if (color_counter == 0)
-  {
-    stream << 1 << std::endl << "\xFF\xFF\xFF";
-  }
-  else
+
+  void finish_rows()
   {
-    stream << color_counter << std::endl;
-    for (size_t color = 0; color < quantized_colors.size(); color++)
+    std::ostream &stream = this->stream;
+    QuantizerWorkspace &workspace = this->workspace;
+    const std::bitset<1 << 18> &original_colors = this->original_colors;
+    std::bitset<1 << 18> quantized_colors;
+    size_t color_counter = original_colors.count();
+    /* Find appropriate color palette: */
+    int divisor = 4;
+    std::vector<Rgb18> &used_colors = workspace.used_colors;
+    used_colors.clear();
+    if (color_counter > djvu::max_fg_colors)
+      for (size_t color = 0; color < original_colors.size(); color++)
+      {
+        if (original_colors[color])
+          used_colors.push_back(Rgb18(color));
+      }
+    while (color_counter > djvu::max_fg_colors)
     {
-      if (quantized_colors[color])
+      size_t new_color_counter = 0;
+      quantized_colors.reset();
+      divisor++;
+      const Reduction reduction(divisor);
+      for (Rgb18 color : used_colors)
       {
-        Rgb18 rgb18(color);
-        unsigned char buffer[3];
-        for (int i = 0; i < 3; i++)
-          buffer[i] = rgb18[i];
-        stream.write(reinterpret_cast<char*>(buffer), 3);
+        Rgb18 new_color = reduction(color);
+        if (!quantized_colors[new_color])
+        {
+          quantized_colors.set(new_color);
+          new_color_counter++;
+          if (new_color_counter > djvu::max_fg_colors)
+            break;
+        }
       }
+      color_counter = new_color_counter;
     }
-  }
-  /* Map colors into color indices: */
-  std::map<int, uint32_t> color_map;
-  uint32_t last_color_index = 0;
-  color_map[-1] = 0xFFF;
-  if (divisor == 4)
-    for (size_t color = 0; color < original_colors.size(); color++)
+    if (divisor == 4)
+      quantized_colors = original_colors;
+    /* Output the palette: */
+    if (color_counter == 0)
     {
-      if (!original_colors[color])
-        continue;
-      color_map[color] = last_color_index++;
+      stream << 1 << std::endl << "\xFF\xFF\xFF";
     }
-  else
-  {
-    std::map<int, uint32_t> quantized_color_map;
-    for (size_t color = 0; color < quantized_colors.size(); color++)
+    else
     {
-      if (!quantized_colors[color])
-        continue;
-      quantized_color_map[color] = last_color_index++;
+      stream << color_counter << std::endl;
+      for (size_t color = 0; color < quantized_colors.size(); color++)
+      {
+        if (quantized_colors[color])
+        {
+          Rgb18 rgb18(color);
+          unsigned char buffer[3];
+          for (int i = 0; i < 3; i++)
+            buffer[i] = rgb18[i];
+          stream.write(reinterpret_cast<char*>(buffer), 3);
+        }
+      }
     }
-    for (size_t color = 0; color < original_colors.size(); color++)
+    /* Map colors into color indices: */
+    std::vector<uint16_t> &color_map = workspace.color_map;
+    uint16_t last_color_index = 0;
+    if (divisor == 4)
+      for (size_t color = 0; color < original_colors.size(); color++)
+      {
+        if (!original_colors[color])
+          continue;
+        color_map[color] = last_color_index++;
+      }
+    else
     {
-      Rgb18 new_color = Rgb18(color).reduce(divisor);
-      color_map[color] = quantized_color_map[new_color];
+      std::vector<uint16_t> &quantized_color_map = workspace.quantized_color_map;
+      for (size_t color = 0; color < quantized_colors.size(); color++)
+      {
+        if (!quantized_colors[color])
+          continue;
+        quantized_color_map[color] = last_color_index++;
+      }
+      const Reduction reduction(divisor);
+      for (Rgb18 color : used_colors)
+        color_map[color] = quantized_color_map[reduction(color)];
     }
-  }
-  /* Output runs: */
-  for (int y = 0; y < height; y++)
-  {
-    const std::vector<Run> line_runs = runs[y];
-    for (const Run &run : line_runs)
+    /* Output runs: */
+    const std::vector<size_t> &row_offsets = workspace.row_offsets;
+    const std::vector<int> &group_ends = workspace.group_ends;
+    std::vector<unsigned char> &buffer = workspace.output_buffer;
+    for (size_t i = 0; i < group_ends.size(); i++)
     {
-      uint32_t color_index = color_map[run.get_color()];
-      write_uint32(stream, (static_cast<uint32_t>(color_index) << 20) + run.get_length());
+      const int group_begin = i > 0 ? group_ends[i - 1] : 0;
+      const int group_end = group_ends[i];
+      const std::vector<Run> &runs = workspace.group_runs[i];
+      for (int y = group_begin; y < group_end; y++)
+      {
+        const size_t begin = row_offsets[y];
+        const size_t end = y + 1 < group_end ? row_offsets[y + 1] : runs.size();
+        buffer.resize(4 * (end - begin));
+        unsigned char *p = buffer.data();
+        for (size_t j = begin; j < end; j++)
+        {
+          const Run &run = runs[j];
+          const Rgb18 color = run.get_color();
+          const uint32_t color_index = color == Rgb18() ? 0xFFF : color_map[color];
+          const uint32_t item = (color_index << 20) + run.get_length();
+          for (int k = 0; k < 4; k++)
+            *p++ = item >> ((3 - k) * 8);
+        }
+        stream.write(reinterpret_cast<char*>(buffer.data()), buffer.size());
+      }
     }
   }
+};
+
+std::unique_ptr<Quantizer::Session> DefaultQuantizer::start(int width, int height,
+  int *background_color, bool &has_foreground, bool &has_background, std::ostream &stream, int n_threads)
+{
+  return std::unique_ptr<Session>(new DefaultSession(
+    width, height,
+    background_color, has_foreground, has_background, stream, n_threads
+  ));
+}
+
+void DefaultQuantizer::operator()(const PixmapView &bmp_fg, const PixmapView &bmp_bg,
+  int *background_color, bool &has_foreground, bool &has_background, std::ostream &stream, int n_threads)
+{
+  quantize_page(*this, bmp_fg, bmp_bg, background_color, has_foreground, has_background, stream, n_threads);
 }
 
 static void dummy_quantizer(int width, int height, int *background_color, std::ostream &stream)
@@ -399,10 +925,87 @@ static void dummy_quantizer(int width, int height, int *background_color, std::o
   background_color[0] = background_color[1] = background_color[2] = 0xFF;
 }
 
-void DummyQuantizer::operator()(pdf::Renderer *out_fg, pdf::Renderer *out_bg, int width, int height,
-  int *background_color, bool &has_foreground, bool &has_background, std::ostream &stream)
+void DummyQuantizer::operator()(const PixmapView &bmp_fg, const PixmapView &bmp_bg,
+  int *background_color, bool &has_foreground, bool &has_background, std::ostream &stream, int n_threads)
+{
+  dummy_quantizer(bmp_fg.get_width(), bmp_fg.get_height(), background_color, stream);
+}
+
+/* The output doesn't depend on the pixels, so it's written upfront: */
+class DummySession : public Quantizer::Session
+{
+public:
+  void add_band(const PixmapView &bmp_fg, const PixmapView &bmp_bg)
+  { }
+  void finish()
+  { }
+};
+
+std::unique_ptr<Quantizer::Session> DummyQuantizer::start(int width, int height,
+  int *background_color, bool &has_foreground, bool &has_background, std::ostream &stream, int n_threads)
 {
   dummy_quantizer(width, height, background_color, stream);
+  return std::unique_ptr<Session>(new DummySession);
+}
+
+/* This is a plain loop over contiguous memory, which is meant to be
+ * vectorized by the compiler.
+ */
+static void add_row(uint16_t * __restrict__ sums, const uint8_t * __restrict__ row, size_t length)
+{
+#if _OPENMP
+  #pragma omp simd
+#endif
+  for (size_t i = 0; i < length; i++)
+    sums[i] += row[i];
+}
+
+void subsample(const PixmapView &bmp, int sub_width, int sub_height, std::ostream &stream)
+{
+  const int width = bmp.get_width();
+  const int height = bmp.get_height();
+  assert(sub_width > 0 && sub_height > 0);
+  /* DjVu decoders scale the background up by ceil(width / sub_width);
+   * calculate_subsampled_size() makes sure the same ratio works vertically: */
+  const int ratio = (width + sub_width - 1) / sub_width;
+  assert(ratio == (height + sub_height - 1) / sub_height);
+  assert((sub_width - 1) * ratio < width);
+  assert((sub_height - 1) * ratio < height);
+  subsample(bmp, ratio, stream);
+}
+
+void subsample(const PixmapView &bmp, int ratio, std::ostream &stream)
+{
+  const int width = bmp.get_width();
+  const int height = bmp.get_height();
+  const int sub_width = (width + ratio - 1) / ratio;
+  const int sub_height = (height + ratio - 1) / ratio;
+  /* 16-bit column sums cannot overflow for sane ratios: */
+  assert(ratio > 0 && ratio <= 256);
+  const size_t row_width = 3 * static_cast<size_t>(width);
+  std::vector<uint16_t> column_sums(row_width);
+  std::vector<unsigned char> buffer(3 * sub_width);
+  for (int sy = 0; sy < sub_height; sy++)
+  {
+    const int y0 = sy * ratio;
+    const int y1 = std::min(y0 + ratio, height);
+    std::fill(column_sums.begin(), column_sums.end(), 0);
+    for (int y = y0; y < y1; y++)
+      add_row(column_sums.data(), bmp.get_row(y), row_width);
+    for (int sx = 0; sx < sub_width; sx++)
+    {
+      const int x0 = sx * ratio;
+      const int x1 = std::min(x0 + ratio, width);
+      const uint32_t n = (x1 - x0) * (y1 - y0);
+      uint32_t sums[3] = {0, 0, 0};
+      for (int x = x0; x < x1; x++)
+      for (int i = 0; i < 3; i++)
+        sums[i] += column_sums[3 * x + i];
+      for (int i = 0; i < 3; i++)
+        buffer[3 * sx + i] = (sums[i] + n / 2) / n;
+    }
+    stream.write(reinterpret_cast<char*>(buffer.data()), buffer.size());
+  }
 }
 
 #if HAVE_GRAPHICSMAGICK
@@ -434,10 +1037,12 @@ static inline unsigned char q2c(MagickLib::Quantum c)
   return ScaleQuantumToChar(c);
 }
 
-void GraphicsMagickQuantizer::operator()(pdf::Renderer *out_fg, pdf::Renderer *out_bg, int width, int height,
-  int *background_color, bool &has_foreground, bool &has_background, std::ostream &stream)
+void GraphicsMagickQuantizer::operator()(const PixmapView &bmp_fg, const PixmapView &bmp_bg,
+  int *background_color, bool &has_foreground, bool &has_background, std::ostream &stream, int n_threads)
 {
-  if (out_fg == out_bg)
+  const int width = bmp_fg.get_width();
+  const int height = bmp_fg.get_height();
+  if (&bmp_fg == &bmp_bg)
   { /* Don't bother to analyze images if they are obviously identical. */
     dummy_quantizer(width, height, background_color, stream);
     has_background = true;
@@ -447,45 +1052,30 @@ void GraphicsMagickQuantizer::operator()(pdf::Renderer *out_fg, pdf::Renderer *o
   Magick::Image image(Magick::Geometry(width, height), Magick::Color());
   image.type(Magick::TrueColorMatteType);
   image.modifyImage();
-  pdf::Pixmap bmp_fg(out_fg);
-  pdf::Pixmap bmp_bg(out_bg);
-  pdf::Pixmap::iterator p_fg = bmp_fg.begin();
-  pdf::Pixmap::iterator p_bg = bmp_bg.begin();
+  const uint8_t *bg0 = bmp_bg.get_row(0);
   for (int i = 0; i < 3; i++)
-    background_color[i] = p_bg[i];
+    background_color[i] = bg0[i];
+  row_mask.resize(width);
+  uint8_t *mask = row_mask.data();
   for (int y = 0; y < height; y++)
   {
+    const uint8_t *p_fg = bmp_fg.get_row(y);
+    const PixelSpan span = diff_row(p_fg, bmp_bg.get_row(y), width, mask,
+      background_color, has_foreground, has_background);
     Magick::PixelPacket* ipixel = image.setPixels(0, y, width, 1);
-    for (int x = 0; x < width; x++)
+    for (int x = 0; x < width; x++, p_fg += 3)
     {
-      if (!has_background)
-      {
-        for (int i = 0; i < 3; i++)
-        if (background_color[i] != p_bg[i])
-        {
-          has_background = true;
-          break;
-        }
-      }
-      if (p_fg[0] != p_bg[0] || p_fg[1] != p_bg[1] || p_fg[2] != p_bg[2])
-      {
-        if (!has_foreground && (p_fg[0] || p_fg[1] || p_fg[2]))
-          has_foreground = true;
+      if (x >= span.begin && x < span.end && mask[x])
         *ipixel = Magick::Color(
           c2q(p_fg[0]),
           c2q(p_fg[1]),
           c2q(p_fg[2]),
           OpaqueOpacity
         );
-      }
       else
         *ipixel = Magick::Color(0, 0, 0, TransparentOpacity);
-      p_fg++;
-      p_bg++;
       ipixel++;
     }
-    p_fg.next_row();
-    p_bg.next_row();
     image.syncPixels();
   }
   image.quantizeColorSpace(Magick::TransparentColorspace);
@@ -544,8 +1134,8 @@ GraphicsMagickQuantizer::GraphicsMagickQuantizer(const Config &config)
   throw NotImplementedError();
 }
 
-void GraphicsMagickQuantizer::operator()(pdf::Renderer *out_fg, pdf::Renderer *out_bg, int width, int height,
-  int *background_color, bool &has_foreground, bool &has_background, std::ostream &stream)
+void GraphicsMagickQuantizer::operator()(const PixmapView &bmp_fg, const PixmapView &bmp_bg,
+  int *background_color, bool &has_foreground, bool &has_background, std::ostream &stream, int n_threads)
 { /* just to satisfy compilers */ }
 
 #endif
@@ -16,20 +16,47 @@
 #ifndef PDF2DJVU_IMAGE_FILTER_H
 #define PDF2DJVU_IMAGE_FILTER_H
 
+#include <memory>
 #include <ostream>
 #include <stdexcept>
 
-#include "pdf-backend.hh"
 #include "config.hh"
 #include "i18n.hh"
+#include "pixmap.hh"
 
 class Quantizer
 {
 protected:
   const Config &config;
 public:
-  virtual void operator()(pdf::Renderer *out_fg, pdf::Renderer *out_bg, int width, int height,
-    int *background_color, bool &has_foreground, bool &has_background, std::ostream &stream) = 0;
+  /* Quantization of a page that is rendered in bands of rows,
+   * from top to bottom.
+   */
+  class Session
+  {
+  public:
+    /* Bands must be as wide as the page. If bmp_fg and bmp_bg are the same
+     * object, there's no foreground in the band, and the page may end up
+     * quantized in the same way as by operator() with identical images: */
+    virtual void add_band(const PixmapView &bmp_fg, const PixmapView &bmp_bg) = 0;
+    /* Called after all the rows of the page have been added: */
+    virtual void finish() = 0;
+    virtual ~Session()
+    { }
+  };
+  /* Quantizers may split the page into groups of rows, and process them
+   * with up to n_threads threads. The output doesn't depend on n_threads.
+   */
+  virtual void operator()(const PixmapView &bmp_fg, const PixmapView &bmp_bg,
+    int *background_color, bool &has_foreground, bool &has_background, std::ostream &stream, int n_threads) = 0;
+  /* Start quantizing a page in bands. The arguments must outlive the session.
+   * Return nullptr if the quantizer needs the whole page at once.
+   */
+  virtual std::unique_ptr<Session> start(int width, int height,
+    int *background_color, bool &has_foreground, bool &has_background, std::ostream &stream, int n_threads)
+  {
+    return nullptr;
+  }
   explicit Quantizer(const Config &config) : config(config) { }
   virtual ~Quantizer()
   { }
@@ -41,20 +68,23 @@ public:
   explicit DefaultQuantizer(const Config &config)
   : Quantizer(config)
   { }
-  virtual void operator()(pdf::Renderer *out_fg, pdf::Renderer *out_bg, int width, int height,
-    int *background_color, bool &has_foreground, bool &has_background, std::ostream &stream);
+  virtual void operator()(const PixmapView &bmp_fg, const PixmapView &bmp_bg,
+    int *background_color, bool &has_foreground, bool &has_background, std::ostream &stream, int n_threads);
+  virtual std::unique_ptr<Session> start(int width, int height,
+    int *background_color, bool &has_foreground, bool &has_background, std::ostream &stream, int n_threads);
 };
 
 class WebSafeQuantizer : public Quantizer
 {
-protected:
-  void output_web_palette(std::ostream &stream);
 public:
+  static void output_web_palette(std::ostream &stream);
   explicit WebSafeQuantizer(const Config &config)
   : Quantizer(config)
   { }
-  virtual void operator()(pdf::Renderer *out_fg, pdf::Renderer *out_bg, int width, int height,
-    int *background_color, bool &has_foreground, bool &has_background, std::ostream &stream);
+  virtual void operator()(const PixmapView &bmp_fg, const PixmapView &bmp_bg,
+    int *background_color, bool &has_foreground, bool &has_background, std::ostream &stream, int n_threads);
+  virtual std::unique_ptr<Session> start(int width, int height,
+    int *background_color, bool &has_foreground, bool &has_background, std::ostream &stream, int n_threads);
 };
 
 class MaskQuantizer : public Quantizer
@@ -63,8 +93,10 @@ public:
   explicit MaskQuantizer(const Config &config)
   : Quantizer(config)
   { }
-  virtual void operator()(pdf::Renderer *out_fg, pdf::Renderer *out_bg, int width, int height,
-    int *background_color, bool &has_foreground, bool &has_background, std::ostream &stream);
+  virtual void operator()(const PixmapView &bmp_fg, const PixmapView &bmp_bg,
+    int *background_color, bool &has_foreground, bool &has_background, std::ostream &stream, int n_threads);
+  virtual std::unique_ptr<Session> start(int width, int height,
+    int *background_color, bool &has_foreground, bool &has_background, std::ostream &stream, int n_threads);
 };
 
 class DummyQuantizer : public Quantizer
@@ -73,16 +105,18 @@ public:
   explicit DummyQuantizer(const Config &config)
   : Quantizer(config)
   { }
-  virtual void operator()(pdf::Renderer *out_fg, pdf::Renderer *out_bg, int width, int height,
-    int *background_color, bool &has_foreground, bool &has_background, std::ostream &stream);
+  virtual void operator()(const PixmapView &bmp_fg, const PixmapView &bmp_bg,
+    int *background_color, bool &has_foreground, bool &has_background, std::ostream &stream, int n_threads);
+  virtual std::unique_ptr<Session> start(int width, int height,
+    int *background_color, bool &has_foreground, bool &has_background, std::ostream &stream, int n_threads);
 };
 
 class GraphicsMagickQuantizer : public Quantizer
 {
 public:
   explicit GraphicsMagickQuantizer(const Config &config);
-  virtual void operator()(pdf::Renderer *out_fg, pdf::Renderer *out_bg, int width, int height,
-    int *background_color, bool &has_foreground, bool &has_background, std::ostream &stream);
+  virtual void operator()(const PixmapView &bmp_fg, const PixmapView &bmp_bg,
+    int *background_color, bool &has_foreground, bool &has_background, std::ostream &stream, int n_threads);
   class NotImplementedError : public std::runtime_error
   {
   public:
@@ -92,6 +126,16 @@ public:
   };
 };
 
+/* Downsample a full-resolution RGB pixmap, averaging over square boxes
+ * of ceil(width / sub_width) pixels. Write raw PPM data, without header.
+ */
+void subsample(const PixmapView &bmp, int sub_width, int sub_height, std::ostream &stream);
+
+/* Same, but with an explicit ratio. The image may be a band of a page,
+ * as long as the band starts at a row that is a multiple of the ratio.
+ */
+void subsample(const PixmapView &bmp, int ratio, std::ostream &stream);
+
 #endif
 
 // vim:ts=2 sts=2 sw=2 et
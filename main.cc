@@ -14,6 +14,7 @@
  */
 
 #include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <cerrno>
 #include <cstddef>
@@ -35,12 +36,18 @@
 #include <omp.h>
 #endif
 
+#if _OPENMP
+#include "bounded-queue.hh"
+#endif
 #include "config.hh"
 #include "debug.hh"
 #include "djvu-const.hh"
+#include "djvu-iff.hh"
 #include "djvu-outline.hh"
 #include "i18n.hh"
 #include "image-filter.hh"
+#include "page-scheduler.hh"
+#include "page-stats.hh"
 #include "paths.hh"
 #include "pdf-backend.hh"
 #include "pdf-document-map.hh"
@@ -51,6 +58,7 @@
 #include "string-printf.hh"
 #include "string-utils.hh"
 #include "system.hh"
+#include "trace.hh"
 #include "version.hh"
 #include "xmp.hh"
 
@@ -150,6 +158,14 @@ public:
   }
 };
 
+static djvu::iff::Form read_iff(File &file)
+{
+  file.reopen();
+  djvu::iff::Form form(file);
+  file.close();
+  return form;
+}
+
 class Component
 {
 protected:
@@ -194,6 +210,35 @@ public:
     return this->file->get_basename();
   }
 
+  djvu::iff::Form read()
+  {
+    return read_iff(*this->file);
+  }
+
+  void write(const djvu::iff::Form &form)
+  {
+    this->file->reopen(std::fstream::trunc);
+    *this->file << form;
+    this->file->close();
+  }
+
+  void append(const std::string &id, const std::string &data)
+  {
+    this->file->reopen();
+    djvu::iff::append(*this->file, id, data);
+    this->file->close();
+  }
+
+  /* Copy the component, without the “AT&T” magic: */
+  void copy_to(std::ostream &stream)
+  {
+    this->file->reopen();
+    std::streamoff size = this->file->size();
+    this->file->seekg(4, std::ios::beg);
+    copy_stream(*this->file, stream, false, size - 4);
+    this->file->close();
+  }
+
   std::streamoff size()
   {
     std::streamoff result;
@@ -261,10 +306,12 @@ protected:
 
 public:
 
-  std::string get_title(int n, const std::string &label) const
+  std::string get_title(int n, const pdf::DocumentMap &document_map) const
   {
     string_format::Bindings bindings = this->get_bindings(n);
-    bindings["label"] = label;
+    /* Page labels are loaded only if they are actually needed: */
+    if (config.page_title_template->uses("label"))
+      bindings["label"] = document_map.get_label(n);
     return config.page_title_template->format(bindings);
   }
 
@@ -279,6 +326,9 @@ public:
     return *tmpfile_ptr;
   }
 
+  virtual File &get_shared_ant_file()
+  = 0;
+
   std::string get_file_name(int n) const
   {
     string_format::Bindings bindings = this->get_bindings(n);
@@ -300,6 +350,18 @@ protected:
   std::vector<sexpr::Ref> annotations;
   const ComponentList &page_files;
   bool skipped_elements;
+  /* Size of the whole page, if only a band of it is rendered: */
+  int page_width, page_height;
+
+  int get_page_width()
+  {
+    return this->page_width > 0 ? this->page_width : this->getBitmapWidth();
+  }
+
+  int get_page_height()
+  {
+    return this->page_height > 0 ? this->page_height : this->getBitmapHeight();
+  }
 
   void add_text_comment(int ox, int oy, int dx, int dy, int x, int y, int w, int h, const Unicode *unistr, int len)
   {
@@ -406,7 +468,12 @@ public:
      * fonts to be set up properly nevertheless:
      */
     state->setRender(0x103);
-    this->skipped_elements = true;
+    /* Invisible text (rendering mode 3), e.g. an OCR layer on top of a scanned
+     * image, is not drawn by the main renderer either. Don't render the page
+     * the second time just because of it.
+     */
+    if (old_render != 3)
+      this->skipped_elements = true;
     this->Renderer::drawChar(state, x, y, dx, dy, origin_x, origin_y, code, n_bytes, unistr, length);
     state->setRender(old_render);
     pdf::splash::Font *font = this->getCurrentFont();
@@ -435,9 +502,9 @@ public:
     ph = std::max(ph, 1.0);
     if (config.text_crop)
     {
-      int bitmap_width = this->getBitmapWidth();
-      int bitmap_height = this->getBitmapHeight();
-      if (px + pw < 0 || py + ph < 0 || px >= bitmap_width || py >= bitmap_height)
+      int page_width = this->get_page_width();
+      int page_height = this->get_page_height();
+      if (px + pw < 0 || py + ph < 0 || px >= page_width || py >= page_height)
         return;
     }
     std::unique_ptr<pdf::NFKC> nfkc;
@@ -539,7 +606,7 @@ public:
     this->cvtUserToDev(x2, y2, &w, &h);
     w -= x;
     h = y - h;
-    y = this->getBitmapHeight() - y;
+    y = this->get_page_height() - y;
     static sexpr::Ref symbol_xor = sexpr::symbol("xor");
     static sexpr::Ref symbol_border = sexpr::symbol("border");
     static sexpr::Ref symbol_rect = sexpr::symbol("rect");
@@ -605,7 +672,7 @@ public:
     pdf::splash::Path path;
     this->convert_path(state, path);
     double area = pdf::get_path_area(path);
-    if (area / this->getBitmapHeight() / this->getBitmapWidth() >= 0.8)
+    if (area / this->get_page_height() / this->get_page_width() >= 0.8)
       Renderer::fill(state);
     else
       this->skipped_elements = true;
@@ -659,10 +726,19 @@ public:
   void clear()
   {
     this->skipped_elements = 0;
+    this->page_width = this->page_height = 0;
     this->clear_texts();
     this->clear_annotations();
   }
 
+  /* Geometry of text and links is computed against the whole page,
+   * even if the page is rendered in bands: */
+  void set_page_size(int width, int height)
+  {
+    this->page_width = width;
+    this->page_height = height;
+  }
+
   bool has_skipped_elements()
   {
     return this->skipped_elements;
@@ -787,18 +863,18 @@ static void pdf_outline_to_djvu_outline(pdf::Document &doc, djvu::Outline &djvu_
   pdf_outline_to_djvu_outline(pdf_outline, catalog, djvu_outline, page_files, 0);
 }
 
-static void add_meta_string(const char *key, const std::string &value, std::ostream &stream)
+static void add_meta_string(const char *key, const std::string &value, sexpr::Ref &expr)
 {
-  sexpr::Ref expr = sexpr::string(value);
-  stream << key << "\t" << expr << std::endl;
+  sexpr::Ref item = sexpr::cons(sexpr::string(value), sexpr::nil);
+  item = sexpr::cons(sexpr::symbol(key), item);
+  expr = sexpr::cons(item, expr);
 }
 
-static void add_meta_date(const char *key, const pdf::Timestamp &value, std::ostream &stream)
+static void add_meta_date(const char *key, const pdf::Timestamp &value, sexpr::Ref &expr)
 {
   try
   {
-    sexpr::Ref sexpr = sexpr::string(value.format(' '));
-    stream << key << "\t" << sexpr << std::endl;
+    add_meta_string(key, value.format(' '), expr);
   }
   catch (const pdf::Timestamp::Invalid &)
   {
@@ -806,9 +882,15 @@ static void add_meta_date(const char *key, const pdf::Timestamp &value, std::ost
   }
 }
 
-static void pdf_metadata_to_djvu_metadata(const pdf::Metadata &metadata, std::ostream &stream)
+static sexpr::Ref pdf_metadata_to_djvu_metadata(const pdf::Metadata &metadata)
 {
-  metadata.iterate<std::ostream>(add_meta_string, add_meta_date, stream);
+  static sexpr::Ref metadata_symbol = sexpr::symbol("metadata");
+  sexpr::Ref expr = sexpr::nil;
+  metadata.iterate<sexpr::Ref>(add_meta_string, add_meta_date, expr);
+  if (static_cast<sexpr::Expr>(expr) == sexpr::nil)
+    return expr;
+  expr.reverse();
+  return sexpr::cons(metadata_symbol, expr);
 }
 
 class TemporaryComponentList : public ComponentList
@@ -834,6 +916,11 @@ public:
     shared_ant_file->close();
   }
 
+  virtual File &get_shared_ant_file()
+  {
+    return *this->shared_ant_file;
+  }
+
   virtual ~TemporaryComponentList()
   {
     this->clean_files();
@@ -847,6 +934,7 @@ private:
   IndirectComponentList& operator=(const IndirectComponentList&) = delete;
 protected:
   const Directory &directory;
+  std::unique_ptr<File> shared_ant_file;
   virtual File *create_file(const std::string &page_id)
   {
     return new File(this->directory, page_id);
@@ -855,6 +943,14 @@ public:
   IndirectComponentList(int n, const PageMap &page_map, const Directory &directory)
   : ComponentList(n, page_map), directory(directory)
   { }
+
+  virtual File &get_shared_ant_file()
+  {
+    /* Create the file only when it's actually needed: */
+    if (this->shared_ant_file.get() == nullptr)
+      this->shared_ant_file.reset(new File(this->directory, djvu::shared_ant_file_name));
+    return *this->shared_ant_file;
+  }
 };
 
 class DjVuCommand : public Command
@@ -885,10 +981,39 @@ public:
   { }
 };
 
+static std::string bzz_encode(const std::string &data)
+/* Compress the data with BZZ, the general-purpose compressor used in DjVu
+ * for DIRM, NAVM, ANTz and TXTz chunks.
+ *
+ * DjVuLibre doesn't expose its BZZ encoder in the library API, so the ``bzz``
+ * tool is used; the data is passed through pipes, without temporary files.
+ */
+{
+  DjVuCommand bzz("bzz");
+  std::ostringstream stream;
+#if WIN32
+  /* Passing data to stdin is not implemented on Windows. */
+  TemporaryFile bzz_file;
+  bzz_file << data;
+  bzz_file.close();
+  bzz << "-e" << bzz_file << "-";
+  bzz(stream);
+#else
+  std::istringstream input(data);
+  bzz << "-e" << "-" << "-";
+  bzz(input, stream);
+#endif
+  return stream.str();
+}
+
 class DjVm
 {
 protected:
   std::set<std::string> known_ids;
+  std::vector<Component> components;
+  ComponentList &page_files;
+  bool needs_shared_ant;
+  std::unique_ptr<std::ostringstream> outline_stream;
   class DuplicateId : public std::runtime_error
   {
   public:
@@ -897,16 +1022,27 @@ protected:
     { }
   };
   void remember(const Component &component);
+  std::string encode_directory(const std::vector<std::streamoff> &sizes) const;
+  std::string encode_outline() const;
 public:
-  virtual void add(const Component &component) = 0;
-  virtual void commit() = 0;
+  explicit DjVm(ComponentList &page_files)
+  : page_files(page_files),
+    needs_shared_ant(false)
+  { }
+  void add(const Component &component)
+  {
+    this->remember(component);
+    this->components.push_back(component);
+  }
+  /* Write the document; return size of the index (or of the whole bundle): */
+  virtual std::streamoff commit() = 0;
   DjVm &operator <<(const Component &component)
   {
     this->add(component);
     return *this;
   }
-  virtual void set_outline(const djvu::Outline &outline) = 0;
-  virtual void set_metadata(File &metadata_sed_file) = 0;
+  virtual void set_outline(const djvu::Outline &outline);
+  void set_metadata(const std::string &shared_ant);
   virtual ~DjVm() { /* just to silence compilers */ }
 };
 
@@ -919,240 +1055,212 @@ void DjVm::remember(const Component &component)
   this->known_ids.insert(id);
 }
 
-class IndirectDjVm;
+std::string DjVm::encode_directory(const std::vector<std::streamoff> &sizes) const
+{
+  bool shared_ant = this->needs_shared_ant;
+  std::ostringstream stream;
+  for (size_t i = 0; i < this->components.size() + shared_ant; i++)
+  {
+    /* Component sizes are 24-bit; larger ones are truncated, as in DjVuLibre. */
+    std::streamoff size = sizes.size() > 0 ? sizes[i] : 0;
+    for (int j = 2; j >= 0; j--)
+      stream << static_cast<char>((size >> (8 * j)) & 0xFF);
+  }
+  if (shared_ant)
+    stream << '\3';
+  for (const Component &component : this->components)
+    stream << (component.get_title().length() == 0 ? '\001' : '\101');
+  if (shared_ant)
+    stream << djvu::shared_ant_file_name << '\0';
+  for (const Component &component : this->components)
+  {
+    stream << component.get_basename() << '\0';
+    const std::string &title = component.get_title();
+    if (title.length() == 0)
+      continue;
+    stream << title << '\0';
+  }
+  return bzz_encode(stream.str());
+}
+
+std::string DjVm::encode_outline() const
+{
+  if (this->outline_stream.get() == nullptr)
+    return "";
+  return bzz_encode(this->outline_stream->str());
+}
+
+void DjVm::set_outline(const djvu::Outline &outline)
+{
+  if (!outline)
+  {
+    this->outline_stream.reset(nullptr);
+    return;
+  }
+  this->outline_stream.reset(new std::ostringstream);
+  *this->outline_stream << outline;
+}
+
+void DjVm::set_metadata(const std::string &shared_ant)
+{
+  debug(3) << _("setting metadata") << std::endl;
+  djvu::iff::Form form("DJVI");
+  if (shared_ant.length() > 0)
+    form.add("ANTz", bzz_encode(shared_ant));
+  File &shared_ant_file = this->page_files.get_shared_ant_file();
+  shared_ant_file.reopen(File::trunc);
+  shared_ant_file << form;
+  shared_ant_file.close();
+  /* Make every page include the shared annotations.
+   * Appending the INCL chunk doesn't require rewriting the whole page.
+   */
+  for (Component &component : this->components)
+    component.append("INCL", djvu::shared_ant_file_name);
+  this->needs_shared_ant = true;
+}
 
 class BundledDjVm : public DjVm
 {
 protected:
-  size_t size;
-  File &output_file;
-  DjVuCommand converter;
-  std::unique_ptr<IndirectDjVm> indirect_djvm;
-  std::unique_ptr<TemporaryFile> index_file;
+  std::ostream &output;
+  /* The output file, or nullptr when writing to standard output: */
+  File *output_file;
 public:
-  explicit BundledDjVm(File &output_file)
-  : size(0),
-    output_file(output_file),
-    converter("djvmcvt")
+  BundledDjVm(File &output_file, ComponentList &page_files)
+  : DjVm(page_files),
+    output(output_file),
+    output_file(&output_file)
   { }
-  ~BundledDjVm()
+  BundledDjVm(std::ostream &output, ComponentList &page_files)
+  : DjVm(page_files),
+    output(output),
+    output_file(nullptr)
   { }
-  virtual void add(const Component &component);
   virtual void set_outline(const djvu::Outline &outline);
-  virtual void set_metadata(File &metadata_sed_file);
-  virtual void commit();
+  virtual std::streamoff commit();
 };
 
 class IndirectDjVm : public DjVm
 {
 protected:
   File &index_file;
-  std::vector<Component> components;
-  bool needs_shared_ant;
-  std::unique_ptr<std::ostringstream> outline_stream;
-  class UnexpectedDjvuSedOutput : public std::runtime_error
-  {
-  public:
-    UnexpectedDjvuSedOutput()
-    : std::runtime_error(_("Unexpected output from djvused"))
-    { }
-  };
-  void create_bare(const std::vector<Component> &components);
-  void create(const std::vector<Component> &components, bool bare=false);
 public:
-  explicit IndirectDjVm(File &index_file)
-  : index_file(index_file),
-    needs_shared_ant(false)
-  { }
-
-  virtual ~IndirectDjVm()
+  IndirectDjVm(File &index_file, ComponentList &page_files)
+  : DjVm(page_files),
+    index_file(index_file)
   { }
-
-  virtual void add(const Component &component)
-  {
-    this->remember(component);
-    this->components.push_back(component);
-  }
-
-  virtual void set_outline(const djvu::Outline &outline)
-  {
-    if (!outline)
-    {
-      this->outline_stream.reset(nullptr);
-      return;
-    }
-    this->outline_stream.reset(new std::ostringstream);
-    *this->outline_stream << outline;
-  }
-
-  virtual void set_metadata(File &metadata_sed_file)
-  {
-    size_t size = this->components.size();
-    {
-      /* Using ``djvused`` to add shared annotations to an indirect multi-page
-       * document could be unacceptably slow:
-       * https://sourceforge.net/p/djvu/bugs/100/
-       *
-       * We need to work around this bug.
-       */
-      debug(3) << _("setting metadata with `djvused`") << std::endl;
-      std::vector<Component> dummy_components;
-      TemporaryFile dummy_sed_file;
-      /* For an indirect document, ``create-shared-ant`` is, surprisingly, not
-       * enough to create a shared annotations chunk. The dummy shared
-       * annotation is actually required.
-       */
-      dummy_sed_file
-        << "create-shared-ant" << std::endl
-        << "set-ant" << std::endl
-        << "(x)" << std::endl
-        << "." << std::endl;
-      dummy_sed_file.close();
-      for (size_t i = 0; i < size - 1; i++)
-      {
-        /* To make the page include the annotations chunk:
-         * - Create an ephemeral indirect multi-page document with just this
-         *   single page.
-         * - Add the dummy shared annotation.
-         */
-        dummy_components.push_back(this->components[i]);
-        this->create_bare(dummy_components);
-        DjVuCommand djvused("djvused");
-        djvused << "-s" << "-f" << dummy_sed_file << this->index_file;
-        djvused(); // djvused -s -f <dummy-sed-file> <output-djvu-file>
-        dummy_components.pop_back();
-      }
-      /* For the last page, use the desired annotations. */
-      dummy_components.push_back(this->components[size - 1]);
-      this->create_bare(dummy_components);
-      DjVuCommand djvused("djvused");
-      djvused << "-s" << "-f" << metadata_sed_file << this->index_file;
-      djvused(); // djvused -s -f <metadata-sed-file> <output-djvu-file>
-      this->needs_shared_ant = true;
-    }
-  }
-
-  virtual void commit()
-  {
-    size_t size = this->components.size();
-    debug(3)
-      << string_printf(ngettext(
-           "creating multi-page indirect document (%zu page)",
-           "creating multi-page indirect document (%zu pages)",
-           size), size
-         )
-      << std::endl;
-    this->create(this->components);
-  }
-
-  void require_shared_ant()
-  {
-    this->needs_shared_ant = true;
-  }
-
+  virtual std::streamoff commit();
 };
 
-void BundledDjVm::add(const Component &component)
-{
-  if (this->index_file.get() == nullptr)
-  {
-    std::ostringstream stream;
-    stream << component << ".djvu-index";
-    this->index_file.reset(new TemporaryFile(stream.str()));
-    this->indirect_djvm.reset(new IndirectDjVm(*this->index_file));
-  }
-  /* No need to call ``this->remember(component)``. */
-  *this->indirect_djvm << component;
-  this->size++;
-}
-
 void BundledDjVm::set_outline(const djvu::Outline &outline)
 {
-  this->indirect_djvm->set_outline(outline);
-  if (this->size < 2)
+  DjVm::set_outline(outline);
+  if (this->components.size() < 2)
     /* Some old DjVuLibre versions (at least 3.5.23) don't preserve outline in
      * single-page documents without shared annotation chunk. Let's work around
      * this problem. */
-    this->indirect_djvm->require_shared_ant();
-}
-
-void BundledDjVm::set_metadata(File &metadata_sed_file)
-{
-  this->indirect_djvm->set_metadata(metadata_sed_file);
-}
-
-void BundledDjVm::commit()
-{
-  this->indirect_djvm->commit();
-  this->converter
-    << "-b"
-    << *this->index_file
-    << this->output_file;
-  this->converter(); // djvmcvt -b <output-djvu-file> <index-djvu-file>
-  this->index_file.reset(nullptr);
-}
-
-void IndirectDjVm::create_bare(const std::vector<Component> &components)
-{
-  this->create(components, true);
+    this->needs_shared_ant = true;
 }
 
-void IndirectDjVm::create(const std::vector<Component> &components, bool bare)
+std::streamoff BundledDjVm::commit()
 {
-  size_t size = components.size();
-  this->index_file.reopen(File::trunc); // (re)open and truncate
-  this->index_file.write("AT&TFORM\0\0\0\0DJVMDIRM\0\0\0\0\1", 25);
-  bool shared_ant = !bare && this->needs_shared_ant;
+  /* Write the bundled document directly, instead of creating an indirect
+   * one and converting it with ``djvmcvt -b``.
+   *
+   * Each component is copied verbatim, except for the “AT&T” magic;
+   * components are aligned to even offsets.
+   *
+   * The document is written sequentially, so it can go straight to a pipe.
+   */
+  bool shared_ant = this->needs_shared_ant;
+  std::vector<Component> components;
+  if (shared_ant)
+    components.push_back(Component(this->page_files.get_shared_ant_file()));
+  for (const Component &component : this->components)
+    components.push_back(component);
+  size_t n = components.size();
+  debug(3)
+    << string_printf(ngettext(
+         "creating multi-page bundled document (%zu page)",
+         "creating multi-page bundled document (%zu pages)",
+         this->components.size()), this->components.size()
+       )
+    << std::endl;
+  std::vector<std::streamoff> sizes;
+  for (Component &component : components)
+    sizes.push_back(component.size() - 4);
+  const std::string &directory = this->encode_directory(sizes);
+  const std::string &outline = this->encode_outline();
+  std::streamoff offset = 4 + 12 + 8 + 3 + 4 * n + directory.length();
+  if (outline.length() > 0)
+  {
+    offset += offset & 1;
+    offset += 8 + outline.length();
+  }
+  std::vector<std::streamoff> offsets;
+  for (std::streamoff size : sizes)
+  {
+    offset += offset & 1;
+    offsets.push_back(offset);
+    offset += size;
+  }
+  std::ostringstream dirm;
+  dirm << '\x81';
   for (int i = 1; i >= 0; i--)
-    index_file << static_cast<char>(((size + shared_ant) >> (8 * i)) & 0xFF);
-  {
-    TemporaryFile bzz_file;
-    for (size_t i = 0; i < size + shared_ant; i++)
-      bzz_file.write("\0\0", 3);
-    if (shared_ant)
-      bzz_file << '\3';
-    for (const Component &component : components)
-      bzz_file << (component.get_title().length() == 0 ? '\001' : '\101');
-    if (shared_ant)
-      bzz_file << djvu::shared_ant_file_name << '\0';
-    for (const Component &component : components)
+    dirm << static_cast<char>((n >> (8 * i)) & 0xFF);
+  for (std::streamoff component_offset : offsets)
+    for (int i = 3; i >= 0; i--)
+      dirm << static_cast<char>((component_offset >> (8 * i)) & 0xFF);
+  dirm << directory;
+  djvu::iff::Form form("DJVM");
+  form.add("DIRM", dirm.str());
+  if (outline.length() > 0)
+    form.add("NAVM", outline);
+  if (this->output_file != nullptr)
+    this->output_file->reopen(File::trunc);
+  std::ostream &output = this->output;
+  output << "AT&T";
+  form.write(output, offset - 4 - form.size());
+  offset = 4 + form.size();
+  for (size_t i = 0; i < n; i++)
+  {
+    if (offset & 1)
     {
-      bzz_file << component.get_basename() << '\0';
-      const std::string &title = component.get_title();
-      if (title.length() == 0)
-        continue;
-      bzz_file << title << '\0';
+      output.put('\0');
+      offset++;
     }
-    bzz_file.close();
-    DjVuCommand bzz("bzz");
-    bzz << "-e" << bzz_file << "-";
-    bzz(index_file);
-  }
-  std::streamoff dirm_off = this->index_file.size();
-  this->index_file.seekp(20, std::ios::beg);
-  for (int i = 3; i >= 0; i--)
-    this->index_file << static_cast<char>(((dirm_off - 24) >> (8 * i)) & 0xFF);
-  dirm_off += dirm_off & 1;
-  if (!bare && this->outline_stream.get())
-  {
-    TemporaryFile bzz_file;
-    this->index_file.seekp(dirm_off, std::ios::beg);
-    index_file.write("NAVM\0\0\0", 8);
-    bzz_file << this->outline_stream->str();
-    bzz_file.close();
-    DjVuCommand bzz("bzz");
-    bzz << "-e" << bzz_file << "-";
-    bzz(index_file);
-    std::streamoff outline_off = index_file.size();
-    this->index_file.seekp(dirm_off + 4, std::ios::beg);
-    for (int i = 3; i >= 0; i--)
-      this->index_file << static_cast<char>(((outline_off - dirm_off - 8) >> (8 * i)) & 0xFF);
+    assert(offset == offsets[i]);
+    components[i].copy_to(output);
+    offset += sizes[i];
   }
-  std::streamoff off = this->index_file.size();
-  this->index_file.seekp(8, std::ios::beg);
-  for (int i = 3; i >= 0; i--)
-    this->index_file << static_cast<char>(((off - 12) >> (8 * i)) & 0xFF);
+  output.flush();
+  return offset;
+}
+
+std::streamoff IndirectDjVm::commit()
+{
+  size_t size = this->components.size() + this->needs_shared_ant;
+  debug(3)
+    << string_printf(ngettext(
+         "creating multi-page indirect document (%zu page)",
+         "creating multi-page indirect document (%zu pages)",
+         this->components.size()), this->components.size()
+       )
+    << std::endl;
+  std::ostringstream dirm;
+  dirm << '\1';
+  for (int i = 1; i >= 0; i--)
+    dirm << static_cast<char>((size >> (8 * i)) & 0xFF);
+  dirm << this->encode_directory(std::vector<std::streamoff>());
+  djvu::iff::Form form("DJVM");
+  form.add("DIRM", dirm.str());
+  if (this->outline_stream.get())
+    form.add("NAVM", this->encode_outline());
+  this->index_file.reopen(File::trunc); // (re)open and truncate
+  this->index_file << form;
+  std::streamoff result = this->index_file.size();
   this->index_file.close();
+  return result;
 }
 
 static int calculate_dpi(const pdf::dpi::Guess &guess)
@@ -1166,16 +1274,16 @@ static int calculate_dpi(const pdf::dpi::Guess &guess)
     return static_cast<int>(dpi);
 }
 
-static int calculate_dpi(pdf::Document &doc, int n, bool crop)
+static int calculate_dpi(pdf::Document &doc, pdf::dpi::Guesser *dpi_guesser, int n, bool crop)
 {
   double page_width, page_height;
   doc.get_page_size(n, crop, page_width, page_height);
   if (config.guess_dpi)
   {
-    pdf::dpi::Guesser dpi_guesser(doc);
+    assert(dpi_guesser != nullptr);
     try
     {
-      pdf::dpi::Guess guess = dpi_guesser[n];
+      pdf::dpi::Guess guess = (*dpi_guesser)[n];
       std::ostringstream guess_str;
       guess_str << guess;
       debug(2)
@@ -1244,102 +1352,813 @@ static void calculate_subsampled_size(int width, int height, int ratio, int &sub
   }
 }
 
-static int xmain(int argc, char * const argv[])
+/* `csepdjvu` with all the options, but without the input and output files: */
+static std::unique_ptr<DjVuCommand> csepdjvu_command(int dpi)
 {
-  std::ios_base::sync_with_stdio(false);
+  std::unique_ptr<DjVuCommand> csepdjvu(new DjVuCommand("csepdjvu"));
+  *csepdjvu << "-d" << dpi;
+  if (config.bg_slices)
+    *csepdjvu << "-q" << config.bg_slices;
+  if (config.text == config.TEXT_LINES)
+    *csepdjvu << "-t";
+  return csepdjvu;
+}
 
-  try
-  {
-    config.read_config(argc, argv);
-  }
-  catch (const Config::NeedVersion &)
-  {
-    std::cout << get_multiline_version();
-    exit(0);
-  }
-  catch (const Config::NeedHelp &)
-  {
-    config.usage();
-    exit(0);
-  }
-  catch (const Config::Error &ex)
+/* class StreamLimit
+ * =================
+ */
+
+/* Limits the number of `csepdjvu` processes started while pages are being
+ * rendered; every one of them holds its page in memory until it's encoded.
+ */
+class StreamLimit
+{
+protected:
+  std::atomic<int> n;
+  const int max;
+public:
+  explicit StreamLimit(int max)
+  : n(0), max(max)
+  { }
+
+  bool acquire()
   {
-    config.usage(ex);
-    if (argc <= 1)
-      prevent_pop_out();
-    exit(1);
+    if (++this->n <= this->max)
+      return true;
+    this->n--;
+    return false;
   }
 
-  if (config.output_stdout)
+  void release()
   {
-    if (isatty(std::cout))
-      throw StdoutIsATerminal();
-    binmode(std::cout);
+    this->n--;
   }
+};
 
-  pdf::Environment environment;
-  environment.set_antialias(config.antialias);
-
-  pdf::DocumentMap document_map(config.filenames);
-  intmax_t pdf_byte_size = document_map.get_byte_size();
-
-  pdf::splash::Color paper_color;
-  pdf::set_color(paper_color, 0xFF, 0xFF, 0xFF);
+/* class EncodingJob
+ * =================
+ */
 
-  intmax_t n_pixels = 0;
-  intmax_t djvu_pages_size = 0;
-  int n_pages = document_map.get_n_pages();
-  PageMap page_map;
-  std::vector<int> page_numbers;
-  std::unique_ptr<const Directory> output_dir;
-  std::unique_ptr<File> output_file;
-  /* `page_files` has to be declared before `djvm`;
-   * otherwise temporary files could be removed in the wrong order:
-   * https://github.com/jwilk/pdf2djvu/issues/114
-   */
-  std::unique_ptr<ComponentList> page_files;
-  std::unique_ptr<DjVm> djvm;
-  std::unique_ptr<Quantizer> quantizer;
-  djvu::Outline djvu_outline;
-  if (config.monochrome)
-    quantizer.reset(new DummyQuantizer(config));
-  else
-    switch (config.fg_colors)
-    {
-    case Config::FG_COLORS_DEFAULT:
-      quantizer.reset(new DefaultQuantizer(config));
-      break;
-    case Config::FG_COLORS_WEB:
-      quantizer.reset(new WebSafeQuantizer(config));
-      break;
-    case Config::FG_COLORS_BLACK:
-      quantizer.reset(new MaskQuantizer(config));
-      break;
-    default:
-      quantizer.reset(new GraphicsMagickQuantizer(config));
-    }
+/* Everything needed to encode a rendered page;
+ * encoding may happen in a different thread than rendering.
+ */
+class EncodingJob
+{
+public:
+  int n;
+  int width, height, dpi;
+  /* Input for `csepdjvu`; nullptr if the page is blank,
+   * or if `csepdjvu` is already running: */
+  std::unique_ptr<TemporaryFile> sep_file;
+  /* `csepdjvu` started by the renderer, if any: */
+  std::unique_ptr<DjVuCommand> csepdjvu;
+  /* To be released when that `csepdjvu` has finished: */
+  StreamLimit *stream_limit;
+  /* Input for `cjb2`; only for monochrome pages: */
+  std::unique_ptr<TemporaryFile> pbm_file;
+  bool has_foreground, has_background, nonwhite_background_color;
+  int background_color[3];
+  /* Uncompressed annotations, if any: */
+  std::string annotations;
+  PageStats stats;
+  explicit EncodingJob(int n)
+  : n(n), width(0), height(0), dpi(0),
+    stream_limit(nullptr),
+    has_foreground(false), has_background(false), nonwhite_background_color(false),
+    background_color{0xFF, 0xFF, 0xFF},
+    stats(n)
+  { }
+};
 
+static int get_thread_num()
+{
 #if _OPENMP
-  if (config.n_jobs >= 1)
-    omp_set_num_threads(config.n_jobs);
+  return omp_get_thread_num();
 #else
-  if (config.n_jobs != 1)
-  {
-    debug(1) << string_printf(_("Warning: %s"), _("pdf2djvu was built without OpenMP support; multi-threading is disabled.")) << std::endl;
-    config.n_jobs = 1;
-  }
+  return 0;
 #endif
+}
 
-  if (config.format == config.FORMAT_BUNDLED)
+#if _OPENMP
+/* Multi-threading would interact badly with logging. Disable it for now. */
+#define debug(x) if (config.n_jobs == 1) (debug)(x)
+#endif
+
+/* class PageRenderer
+ * ==================
+ */
+
+/* Renders pages and prepares data for encoders.
+ * Every thread needs its own instance.
+ */
+class PageRenderer
+{
+private:
+  PageRenderer(const PageRenderer&) = delete;
+  PageRenderer& operator=(const PageRenderer&) = delete;
+protected:
+  pdf::DocumentMap &document_map;
+  pdf::DocumentPool &document_pool;
+  ComponentList &page_files;
+  const PageMap &page_map;
+  Quantizer &quantizer;
+  pdf::splash::Color &paper_color;
+  const bool crop;
+  /* The document has to outlive the objects that use it: */
+  std::unique_ptr<pdf::Document> doc;
+  std::unique_ptr<pdf::dpi::Guesser> dpi_guesser;
+  std::unique_ptr<MainRenderer> out1;
+  std::unique_ptr<MutedRenderer> outm, outs;
+  const char *doc_filename;
+  /* Number of rendering threads that have run out of pages;
+   * the quantizer can use them: */
+  const std::atomic<int> &n_idle_renderers;
+  StreamLimit &stream_limit;
+  void open_document(const char *file_name);
+  bool render_in_bands(EncodingJob &job, int m, int dpi, double page_width, double page_height);
+  std::ostream &open_sep_stream(EncodingJob &job);
+  void close_sep_stream(EncodingJob &job);
+  void store_background(EncodingJob &job, std::ostream &sep_file, int m, double page_width, double page_height,
+    const PixmapView *bmp_bg, File *bg_file, size_t bitmap_size);
+  void store_annotations(EncodingJob &job);
+public:
+  intmax_t n_pixels;
+  PageRenderer(pdf::DocumentMap &document_map, pdf::DocumentPool &document_pool,
+    ComponentList &page_files, const PageMap &page_map,
+    Quantizer &quantizer, pdf::splash::Color &paper_color,
+    const std::atomic<int> &n_idle_renderers, StreamLimit &stream_limit)
+  : document_map(document_map),
+    document_pool(document_pool),
+    page_files(page_files),
+    page_map(page_map),
+    quantizer(quantizer),
+    paper_color(paper_color),
+    crop(!config.use_media_box),
+    doc_filename(nullptr),
+    n_idle_renderers(n_idle_renderers),
+    stream_limit(stream_limit),
+    n_pixels(0)
+  { }
+  std::unique_ptr<EncodingJob> operator()(int n);
+};
+
+void PageRenderer::open_document(const char *file_name)
+{
+  trace::Span span("document", "open");
+  span.args("file", file_name);
+  this->doc_filename = file_name;
+  this->doc.reset(this->document_pool.open(file_name));
+  if (config.guess_dpi)
+    this->dpi_guesser.reset(new pdf::dpi::Guesser(*this->doc));
+  #pragma omp critical
   {
-    if (config.output_stdout)
-      output_file.reset(new TemporaryFile());
-    else
-      output_file.reset(new File(config.output));
-    page_files.reset(new TemporaryComponentList(n_pages, page_map));
-    djvm.reset(new BundledDjVm(*output_file));
+    (debug)(0)--;
+    (debug)(1) << this->doc->get_file_name() << ":" << std::endl;
+    (debug)(0)++;
   }
-  else
+  this->out1.reset(new MainRenderer(this->paper_color, config.monochrome));
+  this->out1->start_doc(this->doc.get());
+  this->outm.reset(new MutedRenderer(this->paper_color, config.monochrome, this->page_files));
+  this->outm->start_doc(this->doc.get());
+  if (!config.monochrome && config.bg_rerender)
+  {
+    this->outs.reset(new MutedRenderer(this->paper_color, config.monochrome, this->page_files));
+    this->outs->start_doc(this->doc.get());
+  }
+}
+
+/* Return the stream for the input of `csepdjvu`. Where possible, `csepdjvu`
+ * is started right away and reads the data from a pipe, while they are
+ * being produced; otherwise, they go to a temporary file.
+ * The process keeps the page until it's encoded, so only a limited number
+ * of them may be running; pages beyond that use temporary files, too.
+ */
+std::ostream &PageRenderer::open_sep_stream(EncodingJob &job)
+{
+#if !WIN32
+  if (this->stream_limit.acquire())
+  {
+    job.stream_limit = &this->stream_limit;
+    job.csepdjvu = csepdjvu_command(job.dpi);
+    *job.csepdjvu << "-" << this->page_files[job.n];
+    return job.csepdjvu->start();
+  }
+#endif
+  job.sep_file.reset(new TemporaryFile());
+  return *job.sep_file;
+}
+
+void PageRenderer::close_sep_stream(EncodingJob &job)
+{
+  if (job.csepdjvu)
+    job.csepdjvu->close_input();
+  else
+    job.sep_file->close();
+}
+
+/* Store the background layer of the page in the sep file. The subsampled
+ * background is computed from bmp_bg, or, if it's nullptr, it's already
+ * in bg_file.
+ */
+void PageRenderer::store_background(EncodingJob &job, std::ostream &sep_file, int m, double page_width, double page_height,
+  const PixmapView *bmp_bg, File *bg_file, size_t bitmap_size)
+{
+  const int width = job.width;
+  const int height = job.height;
+  PageStats &stats = job.stats;
+  MutedRenderer *outs = this->outs.get();
+  PageStats::Stopwatch bg_stopwatch;
+  if (job.has_background)
+  {
+    /* The image has a real (non-solid) background. Store subsampled IW44 image. */
+    int sub_width, sub_height;
+    calculate_subsampled_size(width, height, config.bg_subsample, sub_width, sub_height);
+    if (config.bg_rerender)
+    {
+      double hdpi = sub_width / page_width;
+      double vdpi = sub_height / page_height;
+      debug(3) << _("rendering background image") << std::endl;
+      this->doc->display_page(outs, m, hdpi, vdpi, this->crop, true);
+      if (sub_width != outs->getBitmapWidth())
+        throw std::logic_error(_("Unexpected subsampled bitmap width"));
+      if (sub_height != outs->getBitmapHeight())
+        throw std::logic_error(_("Unexpected subsampled bitmap height"));
+      stats.peak_bitmap_size = std::max(stats.peak_bitmap_size, bitmap_size + outs->get_bitmap_size());
+      pdf::Pixmap bmp(outs);
+      debug(3) << _("storing background image") << std::endl;
+      sep_file << "P6 " << sub_width << " " << sub_height << " 255" << std::endl;
+      sep_file << bmp;
+      outs->clear();
+    }
+    else
+    { /* The muted bitmap is exactly the background, at full resolution: */
+      debug(3) << _("storing background image") << std::endl;
+      sep_file << "P6 " << sub_width << " " << sub_height << " 255" << std::endl;
+      if (bmp_bg != nullptr)
+        subsample(*bmp_bg, sub_width, sub_height, sep_file);
+      else
+      {
+        bg_file->close();
+        bg_file->reopen();
+        copy_stream(*bg_file, sep_file, false);
+      }
+    }
+    job.nonwhite_background_color = false;
+  }
+  else
+  {
+    /* Background is solid. */
+    const int *background_color = job.background_color;
+    job.nonwhite_background_color = (background_color[0] & background_color[1] & background_color[2] & 0xFF) != 0xFF;
+    if (job.nonwhite_background_color)
+    { /* Create a dummy background, just to assure existence of FGbz chunks.
+       * The background chunk will be replaced later: */
+      int sub_width, sub_height;
+      calculate_subsampled_size(width, height, 12, sub_width, sub_height);
+      debug(3) << _("storing dummy background image") << std::endl;
+      sep_file << "P6 " << sub_width << " " << sub_height << " 255" << std::endl;
+      for (int x = 0; x < sub_width; x++)
+      for (int y = 0; y < sub_height; y++)
+        sep_file.write("\xFF\xFF\xFF", 3);
+    }
+  }
+  stats.add_stage("background", bg_stopwatch);
+}
+
+void PageRenderer::store_annotations(EncodingJob &job)
+{
+  MutedRenderer *outm = this->outm.get();
+  sexpr::Guard guard;
+  debug(3) << _("extracting annotations") << std::endl;
+  const std::vector<sexpr::Ref> &annotations = outm->get_annotations();
+  std::ostringstream ant;
+  for (const sexpr::Ref &annotation : annotations)
+    ant << annotation << std::endl;
+  job.annotations = ant.str();
+  outm->clear_annotations();
+}
+
+std::unique_ptr<EncodingJob> PageRenderer::operator()(int n)
+{
+  trace::Span span("page", "render");
+  span.args("page", n);
+  std::unique_ptr<EncodingJob> job(new EncodingJob(n));
+#if USE_HEAP_PROFILING
+  {
+    std::string reason = string_printf("before page #%d", n);
+    HeapProfilerDump(reason.c_str());
+  }
+#endif
+  pdf::PageInfo pi = this->document_map.get(n);
+  int m = pi.local_pageno;
+  if (pi.path != this->doc_filename)
+    this->open_document(pi.path);
+  PageStats &stats = job->stats;
+  stats.file_name = pi.path;
+  stats.local_pageno = m;
+  stats.render_thread = get_thread_num();
+  pdf::Document *doc = this->doc.get();
+  MainRenderer *out1 = this->out1.get();
+  MutedRenderer *outm = this->outm.get();
+  MutedRenderer *outs = this->outs.get();
+  assert(doc != nullptr);
+  assert(out1 != nullptr);
+  assert(outm != nullptr);
+  if (!config.monochrome && config.bg_rerender)
+    assert(outs != nullptr);
+  #pragma omp critical
+  {
+    (debug)(1) << string_printf(_("page #%d -> #%d"), n, this->page_map.get(n));
+    (debug)(1) << std::endl;
+  }
+  debug(0)++;
+  debug(3) << _("rendering page (1st pass)") << std::endl;
+  double page_width, page_height;
+  doc->get_page_size(m, this->crop, page_width, page_height);
+  int dpi = calculate_dpi(*doc, this->dpi_guesser.get(), m, this->crop);
+  if (config.band_height > 0 && !config.monochrome && !config.no_render)
+  {
+    if (this->render_in_bands(*job, m, dpi, page_width, page_height))
+      return job;
+  }
+  {
+    PageStats::Stopwatch stopwatch;
+    doc->display_page(outm, m, dpi, dpi, this->crop, true);
+    stats.add_stage("render-1", stopwatch);
+  }
+  int width = outm->getBitmapWidth();
+  int height = outm->getBitmapHeight();
+  if (width == 1 && height == 1 && page_width * dpi >= 2)
+  {
+    /* When the Splash backend runs out of memory,
+     * it produces a 1x1 bitmap without signalling an error in any way
+     * (other than printing “Out of memory” on stderr).
+     * https://github.com/jwilk/pdf2djvu/issues/107
+     */
+    errno = ENOMEM;
+    throw_posix_error("");
+  }
+  this->n_pixels += width * height;
+  debug(2) << string_printf(_("image size: %dx%d"), width, height) << std::endl;
+  job->width = width;
+  job->height = height;
+  job->dpi = dpi;
+  stats.width = width;
+  stats.height = height;
+  stats.dpi = dpi;
+  stats.has_skipped_elements = outm->has_skipped_elements();
+  size_t bitmap_size = outm->get_bitmap_size();
+  stats.peak_bitmap_size = bitmap_size;
+  std::string texts;
+  if (config.text)
+  {
+    texts = outm->get_texts();
+    outm->clear_texts();
+  }
+  if (texts.empty() && !outm->has_skipped_elements() && outm->is_blank())
+  { /* Nothing to encode but the page size. Don't bother with `csepdjvu`. */
+  }
+  else
+  {
+    if (!config.no_render && outm->has_skipped_elements())
+    { /* Render the page second time, without skipping any elements. */
+      debug(3) << _("rendering page (2nd pass)") << std::endl;
+      PageStats::Stopwatch stopwatch;
+      doc->display_page(out1, m, dpi, dpi, this->crop, false);
+      stats.add_stage("render-2", stopwatch);
+      if (out1->getBitmapWidth() != width || out1->getBitmapHeight() != height)
+      {
+        errno = ENOMEM;
+        throw_posix_error("");
+      }
+      bitmap_size += out1->get_bitmap_size();
+      stats.peak_bitmap_size = bitmap_size;
+    }
+    debug(3) << _("preparing data for `csepdjvu`") << std::endl;
+    debug(0)++;
+    std::ostream &sep_file = this->open_sep_stream(*job);
+    debug(3) << _("storing foreground image") << std::endl;
+    pdf::Pixmap bmp_bg(outm);
+    std::unique_ptr<pdf::Pixmap> bmp_full;
+    if (outm->has_skipped_elements())
+      bmp_full.reset(new pdf::Pixmap(out1));
+    const pdf::Pixmap &bmp_fg = bmp_full ? *bmp_full : bmp_bg;
+    {
+      PageStats::Stopwatch stopwatch;
+      this->quantizer(
+          bmp_fg, bmp_bg,
+          job->background_color, job->has_foreground, job->has_background,
+          sep_file, 1 + this->n_idle_renderers
+      );
+      stats.add_stage("quantize", stopwatch);
+    }
+    this->store_background(*job, sep_file, m, page_width, page_height, &bmp_bg, nullptr, bitmap_size);
+    PageStats::Stopwatch sep_stopwatch;
+    if (config.text)
+    {
+      debug(3) << _("storing text layer") << std::endl;
+      sep_file << texts;
+    }
+    this->close_sep_stream(*job);
+    if (config.monochrome && !config.no_render)
+    { /* The bitmap won't be around at the encoding time: */
+      debug(3) << _("storing monochrome image") << std::endl;
+      job->pbm_file.reset(new TemporaryFile());
+      TemporaryFile &pbm_file = *job->pbm_file;
+      pbm_file << "P4 " << width << " " << height << std::endl;
+      pbm_file << bmp_fg;
+      pbm_file.close();
+    }
+    stats.add_stage("sep-write", sep_stopwatch);
+    debug(0)--;
+  }
+  this->store_annotations(*job);
+  outm->clear();
+  return job;
+}
+
+/* Render the page in bands of about config.band_height rows, so that only
+ * one band of the full-resolution bitmaps is in memory at a time.
+ * Return false, without touching the job, if the quantizer needs the whole
+ * page at once.
+ */
+bool PageRenderer::render_in_bands(EncodingJob &job, int m, int dpi, double page_width, double page_height)
+{
+  pdf::Document *doc = this->doc.get();
+  MainRenderer *out1 = this->out1.get();
+  MutedRenderer *outm = this->outm.get();
+  PageStats &stats = job.stats;
+  /* Splash rounds the page size in the same way: */
+  const int width = static_cast<int>(page_width * dpi + 0.5);
+  const int height = static_cast<int>(page_height * dpi + 0.5);
+  if (width < 1 || height < 1)
+    return false;
+  bool has_foreground = false, has_background = false;
+  int background_color[3] = {0xFF, 0xFF, 0xFF};
+  std::unique_ptr<TemporaryFile> sep_file(new TemporaryFile());
+  std::unique_ptr<Quantizer::Session> session = this->quantizer.start(
+    width, height,
+    background_color, has_foreground, has_background,
+    *sep_file, 1 + this->n_idle_renderers
+  );
+  if (!session)
+    return false;
+  this->n_pixels += width * height;
+  debug(2) << string_printf(_("image size: %dx%d"), width, height) << std::endl;
+  job.width = width;
+  job.height = height;
+  job.dpi = dpi;
+  stats.width = width;
+  stats.height = height;
+  stats.dpi = dpi;
+  /* Every band but the last one must be subsampled to whole rows: */
+  int sub_width, sub_height;
+  calculate_subsampled_size(width, height, config.bg_subsample, sub_width, sub_height);
+  const int ratio = (width + sub_width - 1) / sub_width;
+  const int band_height = (config.band_height + ratio - 1) / ratio * ratio;
+  std::unique_ptr<TemporaryFile> bg_file;
+  if (!config.bg_rerender)
+    bg_file.reset(new TemporaryFile());
+  std::string texts;
+  bool blank = true;
+  outm->set_page_size(width, height);
+  for (int y = 0; y < height; y += band_height)
+  {
+    const int band_rows = std::min(band_height, height - y);
+    debug(3) << _("rendering page (1st pass)") << std::endl;
+    {
+      PageStats::Stopwatch stopwatch;
+      doc->display_page_slice(outm, m, dpi, dpi, this->crop, true, 0, y, width, band_rows);
+      stats.add_stage("render-1", stopwatch);
+    }
+    if (outm->getBitmapWidth() != width || outm->getBitmapHeight() != band_rows)
+    {
+      errno = ENOMEM;
+      throw_posix_error("");
+    }
+    /* The whole content stream is interpreted for every band, so the
+     * first one, which has the same origin as the page, has all the text
+     * and links: */
+    if (y == 0)
+    {
+      if (config.text)
+        texts = outm->get_texts();
+      this->store_annotations(job);
+    }
+    outm->clear_texts();
+    outm->clear_annotations();
+    blank = blank && outm->is_blank();
+    size_t bitmap_size = outm->get_bitmap_size();
+    pdf::Pixmap bmp_bg(outm);
+    std::unique_ptr<pdf::Pixmap> bmp_full;
+    if (outm->has_skipped_elements())
+    {
+      debug(3) << _("rendering page (2nd pass)") << std::endl;
+      PageStats::Stopwatch stopwatch;
+      doc->display_page_slice(out1, m, dpi, dpi, this->crop, false, 0, y, width, band_rows);
+      stats.add_stage("render-2", stopwatch);
+      if (out1->getBitmapWidth() != width || out1->getBitmapHeight() != band_rows)
+      {
+        errno = ENOMEM;
+        throw_posix_error("");
+      }
+      bitmap_size += out1->get_bitmap_size();
+      bmp_full.reset(new pdf::Pixmap(out1));
+    }
+    stats.peak_bitmap_size = std::max(stats.peak_bitmap_size, bitmap_size);
+    const pdf::Pixmap &bmp_fg = bmp_full ? *bmp_full : bmp_bg;
+    {
+      PageStats::Stopwatch stopwatch;
+      session->add_band(bmp_fg, bmp_bg);
+      stats.add_stage("quantize", stopwatch);
+    }
+    if (bg_file)
+    {
+      PageStats::Stopwatch stopwatch;
+      subsample(bmp_bg, ratio, *bg_file);
+      stats.add_stage("background", stopwatch);
+    }
+  }
+  {
+    PageStats::Stopwatch stopwatch;
+    session->finish();
+    stats.add_stage("quantize", stopwatch);
+  }
+  session.reset();
+  stats.has_skipped_elements = outm->has_skipped_elements();
+  if (texts.empty() && !outm->has_skipped_elements() && blank)
+  { /* Nothing to encode but the page size. Don't bother with `csepdjvu`. */
+  }
+  else
+  {
+    debug(3) << _("preparing data for `csepdjvu`") << std::endl;
+    debug(0)++;
+    job.sep_file = std::move(sep_file);
+    job.has_foreground = has_foreground;
+    job.has_background = has_background;
+    std::copy(background_color, background_color + 3, job.background_color);
+    this->store_background(job, *job.sep_file, m, page_width, page_height, nullptr, bg_file.get(), 0);
+    PageStats::Stopwatch sep_stopwatch;
+    if (config.text)
+    {
+      debug(3) << _("storing text layer") << std::endl;
+      *job.sep_file << texts;
+    }
+    job.sep_file->close();
+    stats.add_stage("sep-write", sep_stopwatch);
+    debug(0)--;
+  }
+  outm->clear();
+  return true;
+}
+
+/* If stats_file is not null, write per-page statistics to it: */
+static size_t encode_page(EncodingJob &job, Component &component, std::ostream *stats_file)
+{
+  const int width = job.width;
+  const int height = job.height;
+  const int dpi = job.dpi;
+  trace::Span span("page", "encode");
+  span.args("page", job.n);
+  PageStats &stats = job.stats;
+  stats.encode_thread = get_thread_num();
+  djvu::iff::Form page("DJVU");
+  bool page_modified = false;
+  if (!job.sep_file && !job.csepdjvu)
+  { /* Nothing to encode but the page size. Don't bother with `csepdjvu`: */
+    debug(3) << _("encoding blank page") << std::endl;
+    page.add("INFO", djvu::iff::info_chunk(width, height, dpi));
+    page_modified = true;
+  }
+  else
+  {
+    {
+      debug(3) << _("encoding layers with `csepdjvu`") << std::endl;
+      PageStats::Stopwatch stopwatch;
+      std::unique_ptr<DjVuCommand> csepdjvu;
+      if (job.csepdjvu)
+      { /* It has been running since the page was rendered: */
+        csepdjvu = std::move(job.csepdjvu);
+        csepdjvu->wait();
+        job.stream_limit->release();
+      }
+      else
+      {
+        csepdjvu = csepdjvu_command(dpi);
+        *csepdjvu << *job.sep_file << component;
+        (*csepdjvu)();
+      }
+      stats.add_stage("csepdjvu", stopwatch, csepdjvu->get_cpu_time());
+    }
+    job.sep_file.reset();
+    const bool should_have_fgbz = job.has_background || job.has_foreground || job.nonwhite_background_color;
+    const bool need_reassemble =
+      config.no_render
+      ? false
+      : (config.monochrome || job.nonwhite_background_color || !should_have_fgbz);
+    if (need_reassemble)
+    { /* Re-assemble the page, replacing or dropping some of the chunks
+       * created by csepdjvu: */
+      debug(3) << _("re-assembling page") << std::endl;
+      PageStats::Stopwatch stopwatch;
+      double child_cpu_time = 0;
+      djvu::iff::Form csep_page = component.read();
+      page.add("INFO", djvu::iff::info_chunk(width, height, dpi));
+      if (config.monochrome)
+      { /* Use cjb2 for lossy compression: */
+        assert(job.pbm_file);
+        TemporaryFile sjbz_file;
+        debug(3) << _("encoding monochrome image with `cjb2`") << std::endl;
+        DjVuCommand cjb2("cjb2");
+        cjb2 << "-losslevel" << config.loss_level << *job.pbm_file << sjbz_file;
+        cjb2();
+        child_cpu_time += cjb2.get_cpu_time();
+        page.add(read_iff(sjbz_file), "Sjbz");
+      }
+      else
+        page.add(csep_page, "Sjbz");
+      if (!config.monochrome && job.nonwhite_background_color)
+      { /* Replace previous (dummy) BG44 chunk with the newly created one: */
+        TemporaryDirectory c44_dir;
+        TemporaryFile c44_file(c44_dir, "bg.djvu");
+        c44_file.close();
+        { /* Create solid-color PPM image with subsample ratio 12: */
+          TemporaryFile ppm_file;
+          debug(3) << _("creating new background image with `c44`") << std::endl;
+          DjVuCommand c44("c44");
+          c44 << "-slice" << "97" << ppm_file << c44_file;
+          int bg_width = (width + 11) / 12;
+          int bg_height = (height + 11) / 12;
+          ppm_file << "P6 " << bg_width << " " << bg_height << " 255" << std::endl;
+          for (int y = 0; y < bg_height; y++)
+          for (int x = 0; x < bg_width; x++)
+          for (char c : job.background_color)
+          {
+            ppm_file.write(&c, 1);
+          }
+          ppm_file.close();
+          c44();
+          child_cpu_time += c44.get_cpu_time();
+        }
+        page.add(csep_page, "FGbz");
+        page.add(read_iff(c44_file), "BG44");
+      }
+      else if (!config.monochrome && should_have_fgbz)
+      {
+        page.add(csep_page, "FGbz");
+        page.add(csep_page, "BG44");
+      }
+      page.add(csep_page, "TXTz");
+      page_modified = true;
+      stats.add_stage("reassemble", stopwatch, child_cpu_time);
+    }
+  }
+  job.pbm_file.reset();
+  PageStats::Stopwatch stopwatch;
+  if (job.annotations.length() > 0)
+  { /* Add hyperlinks as a compressed annotation chunk, as djvused did: */
+    debug(3) << _("compressing annotations with `bzz`") << std::endl;
+    if (!page_modified)
+      page = component.read();
+    page.add("ANTz", bzz_encode(job.annotations));
+    page_modified = true;
+  }
+  if (page_modified)
+    component.write(page);
+  size_t page_size = component.size();
+  stats.add_stage("write", stopwatch);
+  if (stats_file != nullptr)
+  {
+    stats.add_chunks(page_modified ? page : component.read());
+    #pragma omp critical(page_stats)
+    {
+      stats.write(*stats_file);
+      *stats_file << std::endl;
+    }
+  }
+  debug(2)
+    << string_printf(ngettext("%zu bytes out", "%zu bytes out", page_size), page_size)
+    << std::endl;
+  debug(0)--;
+  return page_size;
+}
+
+#if _OPENMP
+#undef debug
+#endif
+
+static int xmain(int argc, char * const argv[])
+{
+  std::ios_base::sync_with_stdio(false);
+
+  try
+  {
+    config.read_config(argc, argv);
+  }
+  catch (const Config::NeedVersion &)
+  {
+    std::cout << get_multiline_version();
+    exit(0);
+  }
+  catch (const Config::NeedHelp &)
+  {
+    config.usage();
+    exit(0);
+  }
+  catch (const Config::Error &ex)
+  {
+    config.usage(ex);
+    if (argc <= 1)
+      prevent_pop_out();
+    exit(1);
+  }
+
+  if (config.output_stdout)
+  {
+    if (isatty(std::cout))
+      throw StdoutIsATerminal();
+    binmode(std::cout);
+  }
+
+  if (!config.trace_file.empty())
+    trace::start(config.trace_file);
+
+  TemporaryFile::set_memory_limit(static_cast<uintmax_t>(config.temp_memory) << 20);
+
+  pdf::Environment environment;
+  environment.set_antialias(config.antialias);
+
+#if _OPENMP
+  if (config.n_jobs >= 1)
+    omp_set_num_threads(config.n_jobs);
+  /* Quantizers can split the last pages between idle threads: */
+  omp_set_max_active_levels(2);
+#else
+  if (config.n_jobs != 1)
+  {
+    debug(1) << string_printf(_("Warning: %s"), _("pdf2djvu was built without OpenMP support; multi-threading is disabled.")) << std::endl;
+    config.n_jobs = 1;
+  }
+#endif
+
+  /* Page costs are needed only for scheduling pages between threads: */
+  const bool schedule_by_cost = config.n_jobs != 1;
+  trace::clock::time_point scan_start = trace::clock::now();
+  /* Page labels are needed for page titles, unless the user has overridden
+   * the default template: */
+  const bool load_labels = config.page_title_template->uses("label");
+  pdf::DocumentMap document_map(config.filenames, schedule_by_cost, load_labels);
+  trace::add_event("document", "scan", scan_start);
+  intmax_t pdf_byte_size = document_map.get_byte_size();
+
+  pdf::splash::Color paper_color;
+  pdf::set_color(paper_color, 0xFF, 0xFF, 0xFF);
+
+  intmax_t n_pixels = 0;
+  intmax_t djvu_pages_size = 0;
+  int n_pages = document_map.get_n_pages();
+  PageMap page_map;
+  std::vector<int> page_numbers;
+  std::unique_ptr<const Directory> output_dir;
+  std::unique_ptr<File> output_file;
+  /* `page_files` has to be declared before `djvm`;
+   * otherwise temporary files could be removed in the wrong order:
+   * https://github.com/jwilk/pdf2djvu/issues/114
+   */
+  std::unique_ptr<ComponentList> page_files;
+  std::unique_ptr<DjVm> djvm;
+  std::unique_ptr<Quantizer> quantizer;
+  djvu::Outline djvu_outline;
+  if (config.monochrome)
+    quantizer.reset(new DummyQuantizer(config));
+  else
+    switch (config.fg_colors)
+    {
+    case Config::FG_COLORS_DEFAULT:
+      quantizer.reset(new DefaultQuantizer(config));
+      break;
+    case Config::FG_COLORS_WEB:
+      quantizer.reset(new WebSafeQuantizer(config));
+      break;
+    case Config::FG_COLORS_BLACK:
+      quantizer.reset(new MaskQuantizer(config));
+      break;
+    default:
+      quantizer.reset(new GraphicsMagickQuantizer(config));
+    }
+
+  if (config.format == config.FORMAT_BUNDLED)
+  {
+    if (!config.output_stdout)
+      output_file.reset(new File(config.output));
+    page_files.reset(new TemporaryComponentList(n_pages, page_map));
+    if (output_file)
+      djvm.reset(new BundledDjVm(*output_file, *page_files));
+    else
+      /* Write the document straight to stdout, without a temporary copy: */
+      djvm.reset(new BundledDjVm(std::cout, *page_files));
+  }
+  else
   {
     std::string index_file_name = "index.djvu";
     try
@@ -1376,7 +2195,7 @@ static int xmain(int argc, char * const argv[])
     }
     output_file.reset(new File(*output_dir, index_file_name));
     page_files.reset(new IndirectComponentList(n_pages, page_map, *output_dir));
-    djvm.reset(new IndirectDjVm(*output_file));
+    djvm.reset(new IndirectDjVm(*output_file, *page_files));
   }
   if (config.pages.size() == 0)
     config.pages.push_back({1, n_pages});
@@ -1396,7 +2215,7 @@ static int xmain(int argc, char * const argv[])
     {
       Component &component = (*page_files)[np];
       const std::string &title = component.set_title(
-         page_files->get_title(np, document_map.get(np).label)
+         page_files->get_title(np, document_map)
       );
       if (title.length() > 0)
       {
@@ -1415,294 +2234,101 @@ static int xmain(int argc, char * const argv[])
   if (page_numbers.size() == 0)
     throw Config::NoPagesSelected();
 
-  std::unique_ptr<MainRenderer> out1;
-  std::unique_ptr<MutedRenderer> outm, outs;
-  std::unique_ptr<pdf::Document> doc;
-  const char *doc_filename = nullptr;
-
-  bool crop = !config.use_media_box;
+  pdf::DocumentPool document_pool;
+  std::unique_ptr<File> stats_file;
+  if (!config.stats_file.empty())
+    stats_file.reset(new File(config.stats_file));
 
 #ifdef USE_HEAP_PROFILING
   HeapProfilerStart(config.output.c_str());
 #endif
-  debug(0)++;
-  #pragma omp parallel for private(out1, outm, outs, doc) firstprivate(doc_filename) reduction(+: djvu_pages_size) schedule(runtime)
+  std::vector<PageScheduler::Task> tasks;
   for (size_t i = 0; i < page_numbers.size(); i++)
-  try
   {
     int n = page_numbers[i];
-#if USE_HEAP_PROFILING
-    {
-      std::string reason = string_printf("before page #%d", n);
-      HeapProfilerDump(reason.c_str());
-    }
-#endif
-    pdf::PageInfo pi = document_map.get(n);
-    const char * new_filename = pi.path;
-    int m = pi.local_pageno;
-    if (new_filename != doc_filename)
-    {
-      doc_filename = new_filename;
-      doc.reset(new pdf::Document(doc_filename));
-      #pragma omp critical
-      {
-        debug(0)--;
-        debug(1) << pdf::get_c_string(doc->getFileName()) << ":" << std::endl;
-        debug(0)++;
-      }
-      out1.reset(new MainRenderer(paper_color, config.monochrome));
-      out1->start_doc(doc.get());
-      outm.reset(new MutedRenderer(paper_color, config.monochrome, *page_files));
-      outm->start_doc(doc.get());
-      if (!config.monochrome)
-      {
-        outs.reset(new MutedRenderer(paper_color, config.monochrome, *page_files));
-        outs->start_doc(doc.get());
-      }
-    }
-    assert(doc.get() != nullptr);
-    assert(out1.get() != nullptr);
-    assert(outm.get() != nullptr);
-    if (!config.monochrome)
-      assert(outs.get() != nullptr);
-    Component &component = (*page_files)[n];
-    #pragma omp critical
-    {
-      debug(1) << string_printf(_("page #%d -> #%d"), n, page_map.get(n));
-      debug(1) << std::endl;
-    }
+    tasks.push_back(PageScheduler::Task(i, document_map.get_doc_index(n), document_map.get_cost(n)));
+  }
+  PageScheduler scheduler(tasks, !schedule_by_cost);
+  std::atomic<int> n_idle_renderers(0);
+  debug(0)++;
 #if _OPENMP
-/* Multi-threading would interact badly with logging. Disable it for now. */
-#define debug(x) if (config.n_jobs == 1) (debug)(x)
+  /* Render pages and run encoders in separate threads,
+   * so that rendering doesn't stop while waiting for external encoders.
+   * The threads given by --jobs are split between rendering and encoding,
+   * about two to one. The queue between them holds at most one pending
+   * page per encoder.
+   * With fewer than three threads, every thread renders its pages and then
+   * encodes them: giving up one of only two renderers would slow down
+   * documents that are expensive to render.
+   */
+  const int n_threads_max = config.n_jobs == 1 ? 1 : omp_get_max_threads();
+  const int n_encode_threads = n_threads_max >= 3 ? n_threads_max / 3 : 0;
+  const int n_render_threads = n_threads_max - n_encode_threads;
+  BoundedQueue<std::unique_ptr<EncodingJob>> queue(std::max(1, n_encode_threads));
+  /* A `csepdjvu` started early goes on working while its page waits for an
+   * encoder, and the renderer goes on with the next page. Allow at most one
+   * such process per encoding thread. Without encoding threads, renderers
+   * wait for their `csepdjvu` right after rendering, so each of them may
+   * have one: */
+  StreamLimit stream_limit(n_encode_threads > 0 ? n_encode_threads : n_render_threads);
+  #pragma omp parallel num_threads(n_render_threads + n_encode_threads) reduction(+: djvu_pages_size, n_pixels)
+#else
+  StreamLimit stream_limit(1);
 #endif
-    debug(0)++;
-    debug(3) << _("rendering page (1st pass)") << std::endl;
-    double page_width, page_height;
-    doc->get_page_size(m, crop, page_width, page_height);
-    int dpi = calculate_dpi(*doc, m, crop);
-    doc->display_page(outm.get(), m, dpi, dpi, crop, true);
-    int width = outm->getBitmapWidth();
-    int height = outm->getBitmapHeight();
-    if (width == 1 && height == 1 && page_width * dpi >= 2)
+  /* These exception handlers duplicate the ones in main(), for the sake of OMP.
+   * They should be kept in sync.
+   */
+  try
+  {
+    int n_encoders = 0;
+#if _OPENMP
+    /* The OpenMP runtime might have given us fewer threads than requested: */
+    const int n_threads = omp_get_num_threads();
+    n_encoders = std::min(n_encode_threads, n_threads - 1);
+    if (n_encoders > 0)
     {
-      /* When the Splash backend runs out of memory,
-       * it produces a 1x1 bitmap without signalling an error in any way
-       * (other than printing “Out of memory” on stderr).
-       * https://github.com/jwilk/pdf2djvu/issues/107
-       */
-      errno = ENOMEM;
-      throw_posix_error("");
+      #pragma omp single
+      queue.set_producers(n_threads - n_encoders);
     }
-    n_pixels += width * height;
-    debug(2) << string_printf(_("image size: %dx%d"), width, height) << std::endl;
-    if (!config.no_render && outm->has_skipped_elements())
-    { /* Render the page second time, without skipping any elements. */
-      debug(3) << _("rendering page (2nd pass)") << std::endl;
-      doc->display_page(out1.get(), m, dpi, dpi, crop, false);
-      if (out1->getBitmapWidth() != width || out1->getBitmapHeight() != height)
+    if (omp_get_thread_num() < n_encoders)
+    {
+      while (true)
       {
-        errno = ENOMEM;
-        throw_posix_error("");
+        std::unique_ptr<EncodingJob> job;
+        {
+          trace::Span span("wait", "queue-pop");
+          if (!queue.pop(job))
+            break;
+        }
+        djvu_pages_size += encode_page(*job, (*page_files)[job->n], stats_file.get());
       }
     }
-    debug(3) << _("preparing data for `csepdjvu`") << std::endl;
-    debug(0)++;
-    TemporaryFile sep_file;
-    debug(3) << _("storing foreground image") << std::endl;
-    bool has_background = false;
-    int background_color[3];
-    bool has_foreground = false;
-    bool has_text = false;
-    (*quantizer)(
-        outm->has_skipped_elements()
-        ? static_cast<pdf::Renderer*>(out1.get())
-        : static_cast<pdf::Renderer*>(outm.get()),
-        outm.get(),
-        width, height,
-        background_color, has_foreground, has_background,
-        sep_file
-    );
-    bool nonwhite_background_color;
-    if (has_background)
-    {
-      /* The image has a real (non-solid) background. Store subsampled IW44 image. */
-      int sub_width, sub_height;
-      calculate_subsampled_size(width, height, config.bg_subsample, sub_width, sub_height);
-      double hdpi = sub_width / page_width;
-      double vdpi = sub_height / page_height;
-      debug(3) << _("rendering background image") << std::endl;
-      doc->display_page(outs.get(), m, hdpi, vdpi, crop, true);
-      if (sub_width != outs->getBitmapWidth())
-        throw std::logic_error(_("Unexpected subsampled bitmap width"));
-      if (sub_height != outs->getBitmapHeight())
-        throw std::logic_error(_("Unexpected subsampled bitmap height"));
-      pdf::Pixmap bmp(outs.get());
-      debug(3) << _("storing background image") << std::endl;
-      sep_file << "P6 " << sub_width << " " << sub_height << " 255" << std::endl;
-      sep_file << bmp;
-      nonwhite_background_color = false;
-      outs->clear();
-    }
     else
+#endif
     {
-      /* Background is solid. */
-      nonwhite_background_color = (background_color[0] & background_color[1] & background_color[2] & 0xFF) != 0xFF;
-      if (nonwhite_background_color)
-      { /* Create a dummy background, just to assure existence of FGbz chunks.
-         * The background chunk will be replaced later: */
-        int sub_width, sub_height;
-        calculate_subsampled_size(width, height, 12, sub_width, sub_height);
-        debug(3) << _("storing dummy background image") << std::endl;
-        sep_file << "P6 " << sub_width << " " << sub_height << " 255" << std::endl;
-        for (int x = 0; x < sub_width; x++)
-        for (int y = 0; y < sub_height; y++)
-          sep_file.write("\xFF\xFF\xFF", 3);
-      }
-    }
-    if (config.text)
-    {
-      debug(3) << _("storing text layer") << std::endl;
-      const std::string &texts = outm->get_texts();
-      sep_file << texts;
-      has_text = texts.length() > 0;
-      outm->clear_texts();
-    }
-    sep_file.close();
-    debug(0)--;
-    {
-      debug(3) << _("encoding layers with `csepdjvu`") << std::endl;
-      DjVuCommand csepdjvu("csepdjvu");
-      csepdjvu << "-d" << dpi;
-      if (config.bg_slices)
-        csepdjvu << "-q" << config.bg_slices;
-      if (config.text == config.TEXT_LINES)
-        csepdjvu << "-t";
-      csepdjvu << sep_file << component;
-      csepdjvu();
-    }
-    const bool should_have_fgbz = has_background || has_foreground || nonwhite_background_color;
-    const bool need_reassemble =
-      config.no_render
-      ? false
-      : (config.monochrome || nonwhite_background_color || !should_have_fgbz);
-    TemporaryFile sed_file;
-    if (need_reassemble)
-    {
-      TemporaryFile sjbz_file, fgbz_file, bg44_file;
-      if (!config.monochrome)
-      { /* Extract FGbz and BG44 image chunks, to that they can be mangled and
-         * re-assembled later: */
-        debug(3) << _("recovering images with `djvuextract`") << std::endl;
-        DjVuCommand djvuextract("djvuextract");
-        djvuextract << component;
-        if (should_have_fgbz)
-          djvuextract
-            << std::string("FGbz=") + std::string(fgbz_file)
-            << std::string("BG44=") + std::string(bg44_file);
-        djvuextract << std::string("Sjbz=") + std::string(sjbz_file);
-        djvuextract(config.verbose < 3);
-      }
-      if (config.monochrome)
-      { /* Use cjb2 for lossy compression: */
-        TemporaryFile pbm_file;
-        debug(3) << _("encoding monochrome image with `cjb2`") << std::endl;
-        DjVuCommand cjb2("cjb2");
-        cjb2 << "-losslevel" << config.loss_level << pbm_file << sjbz_file;
-        pbm_file << "P4 " << width << " " << height << std::endl;
-        pdf::Pixmap bmp(
-          outm->has_skipped_elements()
-          ? static_cast<pdf::Renderer*>(out1.get())
-          : static_cast<pdf::Renderer*>(outm.get())
-        );
-        pbm_file << bmp;
-        pbm_file.close();
-        cjb2();
-      }
-      else if (nonwhite_background_color)
+      PageRenderer render_page(document_map, document_pool, *page_files, page_map, *quantizer, paper_color, n_idle_renderers, stream_limit);
+      for (size_t group = PageScheduler::no_group, i; scheduler.next(group, i); )
       {
-        TemporaryDirectory c44_dir;
-        TemporaryFile c44_file(c44_dir, "bg.djvu");
-        c44_file.close();
-        { /* Create solid-color PPM image with subsample ratio 12: */
-          TemporaryFile ppm_file;
-          debug(3) << _("creating new background image with `c44`") << std::endl;
-          DjVuCommand c44("c44");
-          c44 << "-slice" << "97" << ppm_file << c44_file;
-          int bg_width = (width + 11) / 12;
-          int bg_height = (height + 11) / 12;
-          ppm_file << "P6 " << bg_width << " " << bg_height << " 255" << std::endl;
-          for (int y = 0; y < bg_height; y++)
-          for (int x = 0; x < bg_width; x++)
-          for (char c : background_color)
-          {
-            ppm_file.write(&c, 1);
-          }
-          ppm_file.close();
-          c44();
-        }
-        { /* Replace previous (dummy) BG44 chunk with the newly created one: */
-          debug(3) << _("recovering image chunks with `djvuextract`") << std::endl;
-          DjVuCommand djvuextract("djvuextract");
-          djvuextract << c44_file << std::string("BG44=") + std::string(bg44_file);
-          djvuextract(config.verbose < 3);
+        int n = page_numbers[i];
+        std::unique_ptr<EncodingJob> job = render_page(n);
+        if (n_encoders > 0)
+        {
+#if _OPENMP
+          trace::Span span("wait", "queue-push");
+          queue.push(std::move(job));
+#endif
+          continue;
         }
+        djvu_pages_size += encode_page(*job, (*page_files)[n], stats_file.get());
       }
-      if (has_text)
-      { /* Extract hidden text layer (as created by csepdjvu); save it into the sed file: */
-        debug(3) << _("recovering text with `djvused`") << std::endl;
-        DjVuCommand djvused("djvused");
-        djvused << component << "-e" << "output-txt";
-        djvused(sed_file);
-      }
-      { /* Re-assemble new DjVu using previously mangled chunks: */
-        debug(3) << _("re-assembling page with `djvumake`") << std::endl;
-        DjVuCommand djvumake("djvumake");
-        std::ostringstream info;
-        info << "INFO=" << width << "," << height << "," << dpi;
-        djvumake
-          << component
-          << info.str()
-          << std::string("Sjbz=") + std::string(sjbz_file);
-        if (should_have_fgbz && (fgbz_file.size() || bg44_file.size()))
-          djvumake
-            << std::string("FGbz=") + std::string(fgbz_file)
-            << std::string("BG44=") + std::string(bg44_file) + std::string(":99");
-        djvumake();
-      }
-    }
-    { /* Extract annotations (hyperlinks); save it into the sed file: */
-      sexpr::Guard guard;
-      debug(3) << _("extracting annotations") << std::endl;
-      const std::vector<sexpr::Ref> &annotations = outm->get_annotations();
-      sed_file << "select 1" << std::endl << "set-ant" << std::endl;
-      for (const sexpr::Ref &annotation : annotations)
-        sed_file << annotation << std::endl;
-      sed_file << "." << std::endl;
-      outm->clear_annotations();
-    }
-    outm->clear();
-    sed_file.close();
-    { /* Add per-page non-raster data into the DjVu file: */
-      debug(3) << _("adding non-raster data with `djvused`") << std::endl;
-      DjVuCommand djvused("djvused");
-      djvused << component << "-s" << "-f" << sed_file;
-      djvused();
-    }
-    {
-      size_t page_size = component.size();
-      debug(2)
-        << string_printf(ngettext("%zu bytes out", "%zu bytes out", page_size), page_size)
-        << std::endl;
-      djvu_pages_size += page_size;
-    }
-    debug(0)--;
+      n_idle_renderers++;
+      n_pixels += render_page.n_pixels;
 #if _OPENMP
-#undef debug
+      if (n_encoders > 0)
+        queue.close();
 #endif
+    }
   }
-  /* These exception handlers duplicate the ones in main(), for the sake of OMP.
-   * They should be kept in sync.
-   */
   catch (const std::ios_base::failure &ex)
   {
     error_log << string_printf(_("Input/output error (%s)"), ex.what()) << std::endl;
@@ -1720,11 +2346,12 @@ static int xmain(int argc, char * const argv[])
 #ifdef USE_HEAP_PROFILING
   HeapProfilerDump("after last page");
 #endif
+  trace::clock::time_point finish_start = trace::clock::now();
   /* Only first PDF document metadata/outline is taken into account. */
-  doc.reset(new pdf::Document(config.filenames[0]));
+  std::unique_ptr<pdf::Document> doc(new pdf::Document(config.filenames[0]));
   if (config.extract_metadata)
   {
-    TemporaryFile sed_file;
+    std::ostringstream shared_ant;
     pdf::Metadata metadata(*doc);
     debug(3) << _("extracting XMP metadata") << std::endl;
     {
@@ -1746,19 +2373,16 @@ static int xmain(int argc, char * const argv[])
         sexpr::Ref xmp = sexpr::nil;
         xmp = sexpr::cons(sexpr::string(xmp_bytes), xmp);
         xmp = sexpr::cons(xmp_symbol, xmp);
-        sed_file
-          << "create-shared-ant" << std::endl
-          << "set-ant" << std::endl
-          << xmp << std::endl
-          << "." << std::endl;
+        shared_ant << xmp << std::endl;
       }
     }
     debug(3) << _("extracting document-information metadata") << std::endl;
-    sed_file << "set-meta" << std::endl;
-    pdf_metadata_to_djvu_metadata(metadata, sed_file);
-    sed_file << "." << std::endl;
-    sed_file.close();
-    djvm->set_metadata(sed_file);
+    {
+      sexpr::Ref djvu_metadata = pdf_metadata_to_djvu_metadata(metadata);
+      if (static_cast<sexpr::Expr>(djvu_metadata) != sexpr::nil)
+        shared_ant << djvu_metadata << std::endl;
+    }
+    djvm->set_metadata(shared_ant.str());
   }
   if (config.extract_outline)
   {
@@ -1766,9 +2390,8 @@ static int xmain(int argc, char * const argv[])
     pdf_outline_to_djvu_outline(*doc, djvu_outline, *page_files);
     djvm->set_outline(djvu_outline);
   }
-  djvm->commit();
   {
-    size_t djvu_size = output_file->size();
+    size_t djvu_size = djvm->commit();
     if (config.format == config.FORMAT_INDIRECT)
     {
       djvu_size += djvu_pages_size;
@@ -1799,8 +2422,8 @@ static int xmain(int argc, char * const argv[])
          )
       << std::endl;
   }
-  if (config.output_stdout)
-    copy_stream(*output_file, std::cout, true);
+  trace::add_event("document", "finish", finish_start);
+  trace::stop();
 #if USE_HEAP_PROFILING
   HeapProfilerDump("before exit");
   HeapProfilerStop();
@@ -0,0 +1,90 @@
+/* Copyright © 2026 Jakub Wilk <jwilk@jwilk.net>
+ *
+ * This file is part of pdf2djvu.
+ *
+ * pdf2djvu is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * pdf2djvu is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+#include "page-scheduler.hh"
+
+#include <algorithm>
+
+#include "trace.hh"
+
+PageScheduler::PageScheduler(const std::vector<PageScheduler::Task> &tasks, bool ordered)
+: ordered(ordered),
+  next_index(0),
+  tasks(tasks)
+{
+    if (ordered)
+        return;
+    for (const Task &task : tasks)
+    {
+        if (task.group >= this->groups.size())
+        {
+            this->groups.resize(task.group + 1);
+            this->group_costs.resize(task.group + 1);
+        }
+        this->groups[task.group].push_back(task);
+        this->group_costs[task.group] += task.cost;
+    }
+    /* Tasks are taken from the back. Tasks of equal cost should be taken
+     * in the original order: */
+    for (std::vector<Task> &group : this->groups)
+    {
+        std::stable_sort(group.begin(), group.end(),
+            [](const Task &t1, const Task &t2) { return t1.cost > t2.cost; }
+        );
+        std::reverse(group.begin(), group.end());
+    }
+}
+
+bool PageScheduler::next(size_t &group, size_t &index)
+{
+    trace::Span span("wait", "schedule");
+    bool found = false;
+    #pragma omp critical(page_scheduler)
+    if (this->ordered)
+    {
+        if (this->next_index < this->tasks.size())
+        {
+            const Task &task = this->tasks[this->next_index++];
+            group = task.group;
+            index = task.index;
+            found = true;
+        }
+    }
+    else
+    {
+        if (group >= this->groups.size() || this->groups[group].empty())
+        {
+            /* Move on to the group with the most remaining work: */
+            group = no_group;
+            for (size_t i = 0; i < this->groups.size(); i++)
+            {
+                if (this->groups[i].empty())
+                    continue;
+                if (group == no_group || this->group_costs[i] > this->group_costs[group])
+                    group = i;
+            }
+        }
+        if (group != no_group)
+        {
+            const Task task = this->groups[group].back();
+            this->groups[group].pop_back();
+            this->group_costs[group] -= task.cost;
+            index = task.index;
+            found = true;
+        }
+    }
+    return found;
+}
+
+// vim:ts=4 sts=4 sw=4 et
@@ -0,0 +1,67 @@
+/* Copyright © 2026 Jakub Wilk <jwilk@jwilk.net>
+ *
+ * This file is part of pdf2djvu.
+ *
+ * pdf2djvu is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * pdf2djvu is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+#ifndef PDF2DJVU_PAGE_SCHEDULER_HH
+#define PDF2DJVU_PAGE_SCHEDULER_HH
+
+#include <cstddef>
+#include <vector>
+
+/* Hands out tasks (pages) to worker threads, most expensive first.
+ *
+ * Tasks are grouped (by input document). A thread keeps taking tasks
+ * from the group it is already working on, so that it doesn't have to
+ * open another document. Once that group is exhausted, the thread moves
+ * on to the group with the most remaining work, joining other threads
+ * if necessary.
+ */
+class PageScheduler
+{
+public:
+    class Task
+    {
+    public:
+        size_t index;
+        size_t group;
+        double cost;
+        Task(size_t index, size_t group, double cost)
+        : index(index),
+          group(group),
+          cost(cost)
+        { }
+    };
+    static const size_t no_group = static_cast<size_t>(-1);
+protected:
+    bool ordered;
+    size_t next_index;
+    std::vector<Task> tasks;
+    /* Tasks of every group, the most expensive ones last: */
+    std::vector<std::vector<Task>> groups;
+    std::vector<double> group_costs;
+public:
+    /* If ordered is true, costs and groups are ignored,
+     * and tasks are handed out in the original order.
+     */
+    PageScheduler(const std::vector<Task> &tasks, bool ordered = false);
+    /* Get the next task for a thread that worked on the given group before
+     * (or no_group). Update the group accordingly.
+     * Return false if there is nothing left to do.
+     * This is thread-safe.
+     */
+    bool next(size_t &group, size_t &index);
+};
+
+#endif
+
+// vim:ts=4 sts=4 sw=4 et
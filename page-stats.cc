@@ -0,0 +1,109 @@
+/* Copyright © 2026 Jakub Wilk <jwilk@jwilk.net>
+ *
+ * This file is part of pdf2djvu.
+ *
+ * pdf2djvu is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * pdf2djvu is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+#include "page-stats.hh"
+
+#include <algorithm>
+#include <cstring>
+#include <iomanip>
+#include <locale>
+#include <sstream>
+
+#include "string-utils.hh"
+#include "sys-time.hh"
+#include "trace.hh"
+
+PageStats::Stopwatch::Stopwatch()
+: wall_start(std::chrono::steady_clock::now()),
+  cpu_start(get_thread_cpu_time())
+{ }
+
+double PageStats::Stopwatch::get_wall_time() const
+{
+    std::chrono::duration<double> duration = std::chrono::steady_clock::now() - this->wall_start;
+    return duration.count();
+}
+
+double PageStats::Stopwatch::get_cpu_time() const
+{
+    return get_thread_cpu_time() - this->cpu_start;
+}
+
+PageStats::PageStats(int n)
+: n(n),
+  local_pageno(0),
+  width(0), height(0), dpi(0),
+  has_skipped_elements(false),
+  peak_bitmap_size(0),
+  render_thread(0), encode_thread(0)
+{ }
+
+void PageStats::add_stage(const char *name, const PageStats::Stopwatch &stopwatch, double child_cpu_time)
+{
+    const double wall_time = stopwatch.get_wall_time();
+    const double cpu_time = stopwatch.get_cpu_time() + child_cpu_time;
+    auto it = std::find_if(this->stages.begin(), this->stages.end(),
+        [name](const Stage &stage) { return std::strcmp(stage.name, name) == 0; }
+    );
+    if (it != this->stages.end())
+    {
+        it->wall_time += wall_time;
+        it->cpu_time += cpu_time;
+    }
+    else
+        this->stages.push_back(Stage(name, wall_time, cpu_time));
+    trace::add_event("stage", name, stopwatch.get_start(), trace::Args()("page", this->n));
+}
+
+void PageStats::add_chunks(const djvu::iff::Form &form)
+{
+    for (const djvu::iff::Chunk &chunk : form.get_chunks())
+        this->chunk_sizes[chunk.id] += chunk.data.length();
+}
+
+void PageStats::write(std::ostream &stream) const
+{
+    /* JSON numbers must not be affected by the locale: */
+    std::ostringstream json;
+    json.imbue(std::locale::classic());
+    json << std::fixed << std::setprecision(6);
+    json << "{\"page\": " << this->n;
+    json << ", \"file\": " << string::json_quote(this->file_name);
+    json << ", \"file_page\": " << this->local_pageno;
+    json << ", \"width\": " << this->width;
+    json << ", \"height\": " << this->height;
+    json << ", \"dpi\": " << this->dpi;
+    json << ", \"has_skipped_elements\": " << (this->has_skipped_elements ? "true" : "false");
+    json << ", \"peak_bitmap_bytes\": " << this->peak_bitmap_size;
+    json << ", \"render_thread\": " << this->render_thread;
+    json << ", \"encode_thread\": " << this->encode_thread;
+    json << ", \"stages\": {";
+    const char *sep = "";
+    for (const Stage &stage : this->stages)
+    {
+        json << sep << '"' << stage.name << "\": {\"wall\": " << stage.wall_time << ", \"cpu\": " << stage.cpu_time << "}";
+        sep = ", ";
+    }
+    json << "}, \"chunks\": {";
+    sep = "";
+    for (const auto &chunk : this->chunk_sizes)
+    {
+        json << sep << string::json_quote(chunk.first) << ": " << chunk.second;
+        sep = ", ";
+    }
+    json << "}}";
+    stream << json.str();
+}
+
+// vim:ts=4 sts=4 sw=4 et
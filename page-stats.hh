@@ -0,0 +1,83 @@
+/* Copyright © 2026 Jakub Wilk <jwilk@jwilk.net>
+ *
+ * This file is part of pdf2djvu.
+ *
+ * pdf2djvu is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * pdf2djvu is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+#ifndef PDF2DJVU_PAGE_STATS_HH
+#define PDF2DJVU_PAGE_STATS_HH
+
+#include <chrono>
+#include <cstddef>
+#include <map>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "djvu-iff.hh"
+
+/* Performance data of a single page, as reported by --stats.
+ */
+class PageStats
+{
+public:
+    /* Measures wall-clock time and CPU time of the calling thread: */
+    class Stopwatch
+    {
+    protected:
+        std::chrono::steady_clock::time_point wall_start;
+        double cpu_start;
+    public:
+        Stopwatch();
+        std::chrono::steady_clock::time_point get_start() const
+        {
+            return this->wall_start;
+        }
+        double get_wall_time() const;
+        double get_cpu_time() const;
+    };
+    int n;
+    std::string file_name;
+    int local_pageno;
+    int width, height, dpi;
+    bool has_skipped_elements;
+    /* Memory occupied by bitmaps at the same time, at most: */
+    size_t peak_bitmap_size;
+    int render_thread, encode_thread;
+    explicit PageStats(int n);
+    /* Record time spent on a stage (and add it to the trace, if any);
+     * child_cpu_time is CPU time used by external commands.
+     * Times of a stage that is recorded more than once are summed.
+     */
+    void add_stage(const char *name, const Stopwatch &stopwatch, double child_cpu_time = 0);
+    void add_chunks(const djvu::iff::Form &form);
+    /* Write the stats as a JSON object, without trailing newline: */
+    void write(std::ostream &stream) const;
+protected:
+    class Stage
+    {
+    public:
+        const char *name;
+        double wall_time;
+        double cpu_time;
+        Stage(const char *name, double wall_time, double cpu_time)
+        : name(name),
+          wall_time(wall_time),
+          cpu_time(cpu_time)
+        { }
+    };
+    std::vector<Stage> stages;
+    std::map<std::string, size_t> chunk_sizes;
+};
+
+#endif
+
+// vim:ts=4 sts=4 sw=4 et
@@ -130,15 +130,68 @@ void pdf::Environment::set_antialias(bool value)
 
 pdf::Document::Document(const std::string &file_name)
 #if POPPLER_VERSION >= 220300
-: ::PDFDoc(std::make_unique<pdf::String>(file_name.c_str()))
+: ::PDFDoc(std::make_unique<pdf::String>(file_name.c_str())),
 #else
-: ::PDFDoc(new pdf::String(file_name.c_str()))
+: ::PDFDoc(new pdf::String(file_name.c_str())),
 #endif
+  file_name(file_name)
 {
   if (!this->isOk())
     throw LoadError();
 }
 
+static ::BaseStream *new_memory_stream(const MappedFile &file)
+{
+#if POPPLER_VERSION >= 220300
+  const char *data = file.get_data();
+#else
+  /* Older versions of MemStream take non-const data,
+   * but they never modify them: */
+  char *data = const_cast<char *>(file.get_data());
+#endif
+  return new ::MemStream(data, 0, file.get_size(), pdf::Object(objNull));
+}
+
+pdf::Document::Document(const std::string &file_name, std::shared_ptr<const MappedFile> mapped_file)
+: DocumentData(mapped_file),
+  ::PDFDoc(new_memory_stream(*mapped_file)),
+  file_name(file_name)
+{
+  if (!this->isOk())
+    throw LoadError();
+}
+
+
+/* class pdf::DocumentPool
+ * =======================
+ */
+
+pdf::Document *pdf::DocumentPool::open(const std::string &file_name)
+{
+  std::shared_ptr<const MappedFile> mapped_file;
+  #pragma omp critical(pdf_document_pool)
+  {
+    std::weak_ptr<const MappedFile> &entry = this->files[file_name];
+    mapped_file = entry.lock();
+    if (!mapped_file)
+    {
+      try
+      {
+        mapped_file.reset(new MappedFile(file_name));
+        entry = mapped_file;
+      }
+      catch (const POSIXError &)
+      {
+        /* Let Poppler deal with the file (and report errors) on its own. */
+      }
+    }
+  }
+  if (mapped_file)
+    return new pdf::Document(file_name, mapped_file);
+  else
+    return new pdf::Document(file_name);
+}
+
 static std::string html_color(const double rgb[])
 {
   std::ostringstream stream;
@@ -215,6 +268,20 @@ void pdf::Document::display_page(pdf::Renderer *renderer, int npage, double hdpi
   this->processLinks(renderer, npage);
 }
 
+void pdf::Document::display_page_slice(pdf::Renderer *renderer, int npage, double hdpi, double vdpi, bool crop, bool do_links,
+  int x, int y, int width, int height)
+{
+  renderer->link_border_colors.clear();
+  this->displayPageSlice(renderer, npage, hdpi, vdpi, 0, !crop, crop, !do_links,
+    x, y, width, height,
+    nullptr, nullptr,
+    do_links ? annotations_callback : nullptr,
+    do_links ? &renderer->link_border_colors : nullptr
+  );
+  std::reverse(renderer->link_border_colors.begin(), renderer->link_border_colors.end());
+  this->processLinks(renderer, npage);
+}
+
 void pdf::Document::get_page_size(int n, bool crop, double &width, double &height)
 {
   width = crop ?
@@ -229,6 +296,61 @@ void pdf::Document::get_page_size(int n, bool crop, double &width, double &heigh
     std::swap(width, height);
 }
 
+static double get_stream_length(pdf::Object &object)
+{
+  if (!object.isStream())
+    return 0;
+  pdf::Object length;
+  if (!pdf::dict_lookup(object.getStream()->getDict(), "Length", &length)->isInt())
+    return 0;
+  return length.getInt();
+}
+
+double pdf::Document::estimate_page_cost(int n)
+{
+  ::Page *page = this->getPage(n);
+  if (page == nullptr)
+    return 0;
+  /* Page area in pixels, assuming 300 dpi: */
+  double cost = page->getCropWidth() * page->getCropHeight() * (300.0 / 72) * (300.0 / 72);
+  /* Every byte of content stream costs about as much as 64 pixels: */
+  pdf::Object contents = page->getContents();
+  if (contents.isArray())
+  {
+    pdf::Array *array = contents.getArray();
+    for (int i = 0; i < array->getLength(); i++)
+    {
+      pdf::Object item = array->get(i);
+      cost += 64 * get_stream_length(item);
+    }
+  }
+  else
+    cost += 64 * get_stream_length(contents);
+  /* Images have to be decoded (and maybe scaled): */
+  pdf::Dict *resources = page->getResourceDict();
+  pdf::Object xobjects;
+  if (resources != nullptr && pdf::dict_lookup(resources, "XObject", &xobjects)->isDict())
+  {
+    pdf::Dict *dict = xobjects.getDict();
+    for (int i = 0; i < dict->getLength(); i++)
+    {
+      pdf::Object xobject = dict->getVal(i);
+      if (!xobject.isStream())
+        continue;
+      pdf::Dict *xobject_dict = xobject.getStream()->getDict();
+      pdf::Object subtype, width, height;
+      if (!pdf::dict_lookup(xobject_dict, "Subtype", &subtype)->isName("Image"))
+        continue;
+      if (!pdf::dict_lookup(xobject_dict, "Width", &width)->isInt())
+        continue;
+      if (!pdf::dict_lookup(xobject_dict, "Height", &height)->isInt())
+        continue;
+      cost += static_cast<double>(width.getInt()) * height.getInt();
+    }
+  }
+  return cost;
+}
+
 const std::string pdf::Document::get_xmp()
 {
   std::unique_ptr<const pdf::String> mstring;
@@ -488,6 +610,43 @@ void pdf::Renderer::drawLink(pdf::link::Link *link, pdf::Catalog *catalog)
   this->draw_link(link, border_color);
 }
 
+bool pdf::Renderer::is_blank()
+{
+  /* Check if the current bitmap is entirely white. */
+  pdf::splash::Bitmap *bmp = this->getBitmap();
+  const uint8_t *row_ptr = bmp->getDataPtr();
+  int width = bmp->getWidth();
+  int height = bmp->getHeight();
+  size_t byte_width;
+  uint8_t last_byte_mask = 0xFF;
+  switch (bmp->getMode())
+  {
+  case splashModeMono1:
+    byte_width = width / 8;
+    if (width % 8)
+    {
+      last_byte_mask = 0xFF << (8 - width % 8);
+      byte_width++;
+    }
+    break;
+  case splashModeRGB8:
+    byte_width = width * 3;
+    break;
+  default:
+    return false;
+  }
+  for (int y = 0; y < height; y++)
+  {
+    for (size_t x = 0; x + 1 < byte_width; x++)
+      if (row_ptr[x] != 0xFF)
+        return false;
+    if ((row_ptr[byte_width - 1] & last_byte_mask) != last_byte_mask)
+      return false;
+    row_ptr += bmp->getRowSize();
+  }
+  return true;
+}
+
 
 /* glyph-related functions
  * =======================
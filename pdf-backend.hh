@@ -19,7 +19,10 @@
 #include <cassert>
 #include <cstddef>
 #include <cstdint>
+#include <cstdlib>
 #include <ctime>
+#include <map>
+#include <memory>
 #include <ostream>
 #include <stdexcept>
 #include <string>
@@ -27,6 +30,7 @@
 #include <vector>
 
 #include "autoconf.hh"
+#include "pixmap.hh"
 
 // Poppler:
 #include <PDFDoc.h>
@@ -51,6 +55,8 @@
 
 #include "i18n.hh"
 
+class MappedFile;
+
 namespace pdf
 {
 
@@ -79,6 +85,7 @@ namespace pdf
   typedef ::Stream Stream;
   typedef ::Object Object;
   typedef ::Dict Dict;
+  typedef ::Array Array;
   typedef ::Catalog Catalog;
   typedef ::GooString String;
   typedef ::Goffset Offset;
@@ -121,6 +128,9 @@ namespace pdf
     typedef ::GfxColor Color;
     typedef ::GfxRGB RgbColor;
     typedef ::GfxDeviceCMYKColorSpace DeviceCmykColorSpace;
+    typedef ::GfxFunctionShading FunctionShading;
+    typedef ::GfxAxialShading AxialShading;
+    typedef ::GfxRadialShading RadialShading;
   }
 
 /* class pdf::Renderer : pdf::splash::OutputDevice
@@ -140,6 +150,13 @@ namespace pdf
     virtual void draw_link(pdf::link::Link *link, const std::string &border_color)
     { }
     std::vector<std::string> link_border_colors;
+    bool is_blank();
+    /* Memory occupied by the current bitmap, in bytes: */
+    size_t get_bitmap_size()
+    {
+      pdf::splash::Bitmap *bmp = this->getBitmap();
+      return static_cast<size_t>(std::abs(bmp->getRowSize())) * bmp->getHeight();
+    }
     void start_doc(::PDFDoc *doc)
     {
       this->startDoc(doc);
@@ -151,69 +168,20 @@ namespace pdf
   };
 
 
-/* class pdf::Pixmap::iterator
- * ===========================
- */
-
-  class PixmapIterator
-  {
-  protected:
-    const uint8_t *row_ptr;
-    const uint8_t *ptr;
-    size_t row_size;
-  public:
-    PixmapIterator(const uint8_t *raw_data, size_t row_size)
-    {
-      this->row_ptr = this->ptr = raw_data;
-      this->row_size = row_size;
-    }
-
-    PixmapIterator &operator ++(int)
-    {
-      ptr += 3;
-      return *this;
-    }
-
-    void next_row()
-    {
-      ptr = row_ptr = row_ptr + row_size;
-    }
-
-    uint8_t operator[](int n) const
-    {
-      return this->ptr[n];
-    }
-  };
-
-
 /* class pdf::Pixmap
  * =================
  */
 
-  class Pixmap
+  class Pixmap : public PixmapView
   {
   private:
     Pixmap(const Pixmap&) = delete;
     Pixmap& operator=(const Pixmap&) = delete;
   protected:
-    const uint8_t *raw_data;
     pdf::splash::Bitmap *bmp;
-    size_t row_size;
     size_t byte_width;
     bool monochrome;
-    int width, height;
   public:
-    typedef PixmapIterator iterator;
-
-    int get_width() const
-    {
-      return width;
-    }
-    int get_height() const
-    {
-      return height;
-    }
-
     explicit Pixmap(Renderer *renderer)
     {
       bmp = renderer->takeBitmap();
@@ -254,11 +222,6 @@ namespace pdf
       delete bmp;
     }
 
-    PixmapIterator begin() const
-    {
-      return PixmapIterator(raw_data, row_size);
-    }
-
     friend std::ostream &operator<<(std::ostream &, const Pixmap &);
   };
 
@@ -287,12 +250,38 @@ namespace pdf
  * ===================
  */
 
-  class Document : public ::PDFDoc
+  class DocumentData
+  {
+  protected:
+    /* This has to outlive the PDFDoc base of Document: */
+    std::shared_ptr<const MappedFile> mapped_file;
+    explicit DocumentData(std::shared_ptr<const MappedFile> mapped_file = nullptr)
+    : mapped_file(mapped_file)
+    { }
+  };
+
+  class Document : private DocumentData, public ::PDFDoc
   {
+  protected:
+    const std::string file_name;
   public:
     explicit Document(const std::string &file_name);
+    /* Parse the document from a file that is already in memory: */
+    Document(const std::string &file_name, std::shared_ptr<const MappedFile> mapped_file);
+    const std::string &get_file_name() const
+    {
+      return this->file_name;
+    }
     void display_page(Renderer *renderer, int npage, double hdpi, double vdpi, bool crop, bool do_links);
+    /* Render only the given rectangle of the page, in pixels.
+     * Device coordinates are relative to the top-left corner of the rectangle.
+     */
+    void display_page_slice(Renderer *renderer, int npage, double hdpi, double vdpi, bool crop, bool do_links,
+      int x, int y, int width, int height);
     void get_page_size(int n, bool crop, double &width, double &height);
+    /* Very rough estimate of how expensive the page is to convert,
+     * in arbitrary units: */
+    double estimate_page_cost(int n);
     const std::string get_xmp();
     void get_doc_info(pdf::Object &info)
     {
@@ -312,6 +301,24 @@ namespace pdf
   };
 
 
+/* class pdf::DocumentPool
+ * =======================
+ */
+
+  /* Documents opened by the pool share the underlying file data.
+   * Every thread should still open its own document, because the
+   * parsed data structures are not thread-safe.
+   */
+  class DocumentPool
+  {
+  protected:
+    std::map<std::string, std::weak_ptr<const MappedFile>> files;
+  public:
+    /* This is thread-safe: */
+    Document *open(const std::string &file_name);
+  };
+
+
 /* class pdf::Timestamp
  * ====================
  */
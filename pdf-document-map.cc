@@ -16,59 +16,103 @@
 
 #include <algorithm>
 #include <cstddef>
-#include <fstream>
-#include <memory>
+#include <exception>
+
+#include <sys/stat.h>
 
 #include "autoconf.hh"
 #include "pdf-backend.hh"
 #include "pdf-unicode.hh"
+#include "system.hh"
 
-pdf::DocumentMap::DocumentMap(const std::vector<const char *> &paths)
-: paths(paths)
+pdf::DocumentMap::DocumentMap(const std::vector<const char *> &paths, bool estimate_costs, bool load_labels)
+: paths(paths),
+  labels(paths.size())
 {
-    int global_index = 0;
-    this->byte_size = 0;
-    for (const char *path : paths)
+    const size_t n_docs = paths.size();
+    std::vector<int> n_pages(n_docs);
+    std::vector<intmax_t> sizes(n_docs);
+    std::vector<std::vector<double>> doc_costs(n_docs);
+    std::vector<std::exception_ptr> errors(n_docs);
+    /* Exceptions must not escape the OpenMP region; they are rethrown later,
+     * in the order of the input files: */
+    #pragma omp parallel for schedule(dynamic)
+    for (size_t i = 0; i < n_docs; i++)
+    try
     {
-        this->indices.push_back(global_index);
-        {
-            std::ifstream ifs(path, std::ifstream::in | std::ifstream::binary);
-            ifs.seekg(0, std::ios::end);
-            this->byte_size += ifs.tellg();
-            ifs.close();
-        }
+        pdf::Document doc(paths[i]);
+        n_pages[i] = doc.getNumPages();
+        if (estimate_costs)
+            for (int n = 1; n <= n_pages[i]; n++)
+                doc_costs[i].push_back(doc.estimate_page_cost(n));
+        if (load_labels)
         {
-            std::unique_ptr<pdf::Document> doc(new pdf::Document(path));
-            pdf::Catalog *catalog = doc->getCatalog();
-            for (int i = 0; i < doc->getNumPages(); i++) {
+            pdf::Catalog *catalog = doc.getCatalog();
+            for (int n = 0; n < n_pages[i]; n++)
+            {
                 pdf::String s;
-                if (catalog->indexToLabel(i, &s)) {
-                    std::string str = pdf::string_as_utf8(&s);
-                    this->labels.push_back(str);
-                }
+                if (catalog->indexToLabel(n, &s))
+                    this->labels[i].push_back(pdf::string_as_utf8(&s));
                 else
-                    this->labels.push_back("");
-                global_index++;
+                    this->labels[i].push_back("");
             }
         }
+        struct stat st;
+        if (stat(paths[i], &st) < 0)
+            throw_posix_error(paths[i]);
+        sizes[i] = st.st_size;
+    }
+    catch (...)
+    {
+        errors[i] = std::current_exception();
+    }
+    for (const std::exception_ptr &error : errors)
+        if (error)
+            std::rethrow_exception(error);
+    int global_index = 0;
+    this->byte_size = 0;
+    for (size_t i = 0; i < n_docs; i++)
+    {
+        this->indices.push_back(global_index);
+        this->byte_size += sizes[i];
+        global_index += n_pages[i];
+        if (estimate_costs)
+            this->costs.insert(this->costs.end(), doc_costs[i].begin(), doc_costs[i].end());
     }
     this->indices.push_back(global_index);
 }
 
-pdf::PageInfo pdf::DocumentMap::get(int global_pageno)
+size_t pdf::DocumentMap::get_doc_index(int global_pageno) const
 {
     int global_index = global_pageno - 1;
-    size_t doc_index = std::upper_bound(
+    return std::upper_bound(
         this->indices.begin(),
         this->indices.end(),
         global_index
     ) - this->indices.begin() - 1;
+}
+
+pdf::PageInfo pdf::DocumentMap::get(int global_pageno)
+{
+    size_t doc_index = this->get_doc_index(global_pageno);
     return pdf::PageInfo(
-        global_index + 1,
+        global_pageno,
         /* path = */ this->paths.at(doc_index),
-        /* local_index = */ global_pageno - this->indices.at(doc_index),
-        /* label = */ this->labels.at(global_index)
+        /* local_index = */ global_pageno - this->indices.at(doc_index)
     );
 }
 
+double pdf::DocumentMap::get_cost(int global_pageno) const
+{
+    if (this->costs.empty())
+        return 0;
+    return this->costs.at(global_pageno - 1);
+}
+
+const std::string &pdf::DocumentMap::get_label(int global_pageno) const
+{
+    size_t doc_index = this->get_doc_index(global_pageno);
+    return this->labels.at(doc_index).at(global_pageno - 1 - this->indices.at(doc_index));
+}
+
 // vim:ts=4 sts=4 sw=4 et
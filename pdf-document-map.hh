@@ -28,12 +28,10 @@ namespace pdf
         const int global_pageno;
         const char *path;
         const int local_pageno;
-        const std::string &label;
-        PageInfo(int global_pageno, const char *path, int local_pageno, const std::string &label)
+        PageInfo(int global_pageno, const char *path, int local_pageno)
         : global_pageno(global_pageno),
           path(path),
-          local_pageno(local_pageno),
-          label(label)
+          local_pageno(local_pageno)
         { }
     };
 
@@ -42,10 +40,16 @@ namespace pdf
     protected:
         intmax_t byte_size;
         const std::vector<const char *> &paths;
-        std::vector<std::string> labels;
+        /* Page labels, if they were loaded: */
+        std::vector<std::vector<std::string>> labels;
         std::vector<int> indices;
+        std::vector<double> costs;
     public:
-        explicit DocumentMap(const std::vector<const char *> &paths);
+        /* Input files are scanned in parallel (if OpenMP is enabled).
+         * If load_labels is true, page labels are loaded in the same pass;
+         * otherwise, get_label() must not be used.
+         */
+        explicit DocumentMap(const std::vector<const char *> &paths, bool estimate_costs, bool load_labels);
         intmax_t get_byte_size()
         {
             return this->byte_size;
@@ -55,6 +59,12 @@ namespace pdf
             return this->indices.back();
         }
         PageInfo get(int global_index);
+        const std::string &get_label(int global_pageno) const;
+        /* See pdf::Document::estimate_page_cost().
+         * Returns 0 unless costs were estimated when the map was built.
+         */
+        double get_cost(int global_pageno) const;
+        size_t get_doc_index(int global_pageno) const;
     };
 
 }
@@ -61,6 +61,29 @@ protected:
     this->process_image(state, mask_width, mask_height);
   }
 
+  /* Pretend that smooth shadings are handled natively,
+   * so that Gfx doesn't bother to subdivide them into tiny fills:
+   */
+  virtual bool useShadedFills(int type)
+  {
+    return type >= 1 && type <= 3;
+  }
+
+  virtual bool functionShadedFill(pdf::gfx::State *state, pdf::gfx::FunctionShading *shading)
+  {
+    return true;
+  }
+
+  virtual bool axialShadedFill(pdf::gfx::State *state, pdf::gfx::AxialShading *shading, double t_min, double t_max)
+  {
+    return true;
+  }
+
+  virtual bool radialShadedFill(pdf::gfx::State *state, pdf::gfx::RadialShading *shading, double s_min, double s_max)
+  {
+    return true;
+  }
+
   virtual bool interpretType3Chars()
   {
     return false;
@@ -113,6 +136,7 @@ pdf::dpi::Guesser::~Guesser()
 
 pdf::dpi::Guess pdf::dpi::Guesser::operator[](int n)
 {
+  /* Images are not decoded here; only their dimensions and CTMs matter: */
   DpiGuessDevice *guess_device = static_cast<DpiGuessDevice*>(this->magic);
   guess_device->reset();
   this->document.displayPages(guess_device, n, n, 72, 72, 0, true, false, false);
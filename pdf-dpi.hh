@@ -38,6 +38,9 @@ namespace pdf
     class NoGuess
     { };
 
+    /* Guesser can be kept for the lifetime of the document,
+     * so that the guessing device is set up only once.
+     */
     class Guesser
     {
     protected:
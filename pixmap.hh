@@ -0,0 +1,105 @@
+/* Copyright © 2026 Jakub Wilk <jwilk@jwilk.net>
+ *
+ * This file is part of pdf2djvu.
+ *
+ * pdf2djvu is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * pdf2djvu is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+#ifndef PDF2DJVU_PIXMAP_HH
+#define PDF2DJVU_PIXMAP_HH
+
+#include <cstddef>
+#include <cstdint>
+
+/* class PixmapIterator
+ * ====================
+ */
+
+class PixmapIterator
+{
+protected:
+  const uint8_t *row_ptr;
+  const uint8_t *ptr;
+  size_t row_size;
+public:
+  PixmapIterator(const uint8_t *raw_data, size_t row_size)
+  {
+    this->row_ptr = this->ptr = raw_data;
+    this->row_size = row_size;
+  }
+
+  PixmapIterator &operator ++(int)
+  {
+    ptr += 3;
+    return *this;
+  }
+
+  void next_row()
+  {
+    ptr = row_ptr = row_ptr + row_size;
+  }
+
+  uint8_t operator[](int n) const
+  {
+    return this->ptr[n];
+  }
+};
+
+
+/* class PixmapView
+ * ================
+ */
+
+/* Read-only view of an RGB image in memory, 3 bytes per pixel.
+ * Rows are row_size bytes apart.
+ * The view doesn't own the data.
+ */
+class PixmapView
+{
+private:
+  PixmapView(const PixmapView&) = delete;
+  PixmapView& operator=(const PixmapView&) = delete;
+protected:
+  const uint8_t *raw_data;
+  size_t row_size;
+  int width, height;
+  PixmapView()
+  : raw_data(nullptr), row_size(0), width(0), height(0)
+  { }
+public:
+  typedef PixmapIterator iterator;
+
+  PixmapView(const uint8_t *raw_data, int width, int height, size_t row_size)
+  : raw_data(raw_data), row_size(row_size), width(width), height(height)
+  { }
+
+  int get_width() const
+  {
+    return width;
+  }
+  int get_height() const
+  {
+    return height;
+  }
+
+  PixmapIterator begin() const
+  {
+    return PixmapIterator(raw_data, row_size);
+  }
+
+  const uint8_t *get_row(int y) const
+  {
+    return raw_data + y * row_size;
+  }
+};
+
+#endif
+
+// vim:ts=2 sts=2 sw=2 et
@@ -32,14 +32,20 @@ namespace rle
     unsigned int run_length;
     int last_pixel;
   public:
-    template <typename T> R4(std::ostream &, T width, T height);
+    /* If header is false, only the image data is written; rows are
+     * encoded independently, so a band of rows can be encoded separately.
+     */
+    template <typename T> R4(std::ostream &, T width, T height, bool header = true);
+    template <typename T> static void write_header(std::ostream &, T width, T height);
     void operator <<(int pixel);
+    /* Same as n times << pixel: */
+    template <typename T> void put(int pixel, T n);
     template <typename T> void output_run(T);
   };
 }
 
 template <typename T>
-rle::R4::R4(std::ostream &stream, T width_, T height_)
+rle::R4::R4(std::ostream &stream, T width_, T height_, bool header)
 : stream(stream),
   x(0), width(width_), height(height_),
   run_length(0),
@@ -49,7 +55,14 @@ rle::R4::R4(std::ostream &stream, T width_, T height_)
   assert(height_ > 0);
   assert(static_cast<T>(this->width) == width_);
   assert(static_cast<T>(this->height) == height_);
-  this->stream << "R4 " << this->width << " " << this->height << " ";
+  if (header)
+    write_header(stream, width_, height_);
+}
+
+template <typename T>
+void rle::R4::write_header(std::ostream &stream, T width, T height)
+{
+  stream << "R4 " << width << " " << height << " ";
 }
 
 void rle::R4::operator <<(int pixel)
@@ -74,6 +87,34 @@ void rle::R4::operator <<(int pixel)
   }
 }
 
+template <typename T>
+void rle::R4::put(int pixel, T n_)
+{
+  unsigned int n = n_;
+  assert(n_ >= 0);
+  assert(static_cast<T>(n) == n_);
+  if (n == 0)
+    return;
+  pixel = !!pixel;
+  this->x += n;
+  assert(this->x <= this->width);
+  if (this->last_pixel != pixel)
+  {
+    this->output_run(this->run_length);
+    this->run_length = n;
+    this->last_pixel = pixel;
+  }
+  else
+    this->run_length += n;
+  if (this->x == this->width)
+  {
+    this->output_run(this->run_length);
+    this->last_pixel = 0;
+    this->x = 0;
+    this->run_length = 0;
+  }
+}
+
 template <typename T>
 void rle::R4::output_run(T length_)
 {
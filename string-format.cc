@@ -56,6 +56,10 @@ namespace string_format
     virtual ~VariableChunk()
     { }
     virtual void format(const Bindings &, std::ostream &) const;
+    virtual bool uses(const std::string &variable) const
+    {
+      return this->variable == variable;
+    }
   };
 
   class ValueError : public std::domain_error
@@ -336,4 +340,12 @@ std::string string_format::Template::format(const Bindings &bindings) const
   return stream.str();
 }
 
+bool string_format::Template::uses(const std::string &variable) const
+{
+  for (const Chunk* chunk : this->chunks)
+    if (chunk->uses(variable))
+      return true;
+  return false;
+}
+
 // vim:ts=2 sts=2 sw=2 et
@@ -55,6 +55,10 @@ namespace string_format
   public:
     virtual void format(const Bindings &bindings, std::ostream &stream) const
     = 0;
+    virtual bool uses(const std::string &variable) const
+    {
+      return false;
+    }
     virtual ~Chunk()
     { }
   };
@@ -71,6 +75,7 @@ namespace string_format
     ~Template();
     void format(const Bindings &, std::ostream &) const;
     std::string format(const Bindings &) const;
+    bool uses(const std::string &variable) const;
   };
 
   class ParseError : public std::runtime_error
@@ -15,6 +15,7 @@
 #include "string-utils.hh"
 
 #include <cstddef>
+#include <cstdio>
 
 void string::split(const std::string &s, char c, std::vector<std::string> &result)
 {
@@ -43,4 +44,22 @@ void string::replace_all(std::string& s, char pat, const std::string& repl)
     replace_all(s, std::string(1, pat), repl);
 }
 
+std::string string::json_quote(const std::string &s)
+{
+    std::string result = "\"";
+    for (char c : s) {
+        if (c == '"' || c == '\\') {
+            result += '\\';
+            result += c;
+        } else if (static_cast<unsigned char>(c) < 0x20) {
+            char buffer[8];
+            std::snprintf(buffer, sizeof buffer, "\\u%04x", static_cast<unsigned int>(c));
+            result += buffer;
+        } else
+            result += c;
+    }
+    result += '"';
+    return result;
+}
+
 // vim:ts=4 sts=4 sw=4 et
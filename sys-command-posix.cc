@@ -25,12 +25,17 @@
 #include <cstdlib>
 #include <cstring>
 #include <csignal>
+#include <memory>
+#include <ostream>
 #include <sstream>
+#include <streambuf>
 #include <string>
 #include <vector>
 
 #include <fcntl.h>
 #include <poll.h>
+#include <sys/resource.h>
+#include <sys/time.h>
 #include <sys/wait.h>
 #include <unistd.h>
 
@@ -40,8 +45,14 @@
 
 #include "string-printf.hh"
 #include "i18n.hh"
+#include "trace.hh"
 
-Command::Command(const std::string& command) : command(command)
+Command::Command(const std::string& command)
+: command(command),
+  cpu_time(0),
+  pid(-1),
+  error_fd(-1),
+  stdin_errno(0)
 {
     this->argv.push_back(command);
 }
@@ -65,6 +76,17 @@ Command &Command::operator <<(int i)
     return *this << stream.str();
 }
 
+static std::string join_argv(const std::vector<std::string> &argv)
+{
+    std::string result;
+    for (const std::string &arg : argv) {
+        if (!result.empty())
+            result += ' ';
+        result += arg;
+    }
+    return result;
+}
+
 static int get_max_fd()
 {
     int max_fd_per_thread = 16; // rough estimate
@@ -196,22 +218,13 @@ std::string Command::repr()
         );
 }
 
-void Command::call(std::istream *stdin_, std::ostream *stdout_, bool stderr_)
+// Start the command, with stdin_fd and stdout_fd as its standard input and
+// output; if stdout_fd is negative, standard output is discarded.
+// The child reports errors that happen before exec() through error_fd.
+static pid_t spawn(const std::vector<const char *> &c_argv, int stdin_fd, int stdout_fd, int error_fd, bool stderr_)
 {
     int rc;
     int max_fd = get_max_fd();
-    int stdout_pipe[2];
-    int stdin_pipe[2];
-    int error_pipe[2];
-    size_t argc = this->argv.size();
-    std::vector<const char *> c_argv(argc + 1);
-    for (size_t i = 0; i < argc; i++)
-        c_argv[i] = argv[i].c_str();
-    c_argv[argc] = nullptr;
-    assert(c_argv[0] != nullptr);
-    mkfifo(stdout_pipe);
-    mkfifo(stdin_pipe, O_NONBLOCK);
-    mkfifo(error_pipe);
     pid_t pid = fork();
     if (pid < 0)
         throw_posix_error("fork()");
@@ -219,97 +232,68 @@ void Command::call(std::istream *stdin_, std::ostream *stdout_, bool stderr_)
         // The child:
         // At this point, only async-signal-safe functions can be used.
         // See the signal(7) manpage for the full list.
-        rc = dup2(stdin_pipe[0], STDIN_FILENO);
+        rc = dup2(stdin_fd, STDIN_FILENO);
         if (rc < 0) {
-            report_posix_error(error_pipe[1], "dup2()");
+            report_posix_error(error_fd, "dup2()");
             abort();
         }
-        rc = dup2(stdout_pipe[1], STDOUT_FILENO);
+        if (stdout_fd < 0) {
+            stdout_fd = open("/dev/null", O_WRONLY);
+            if (stdout_fd < 0) {
+                report_posix_error(error_fd, "open()");
+                abort();
+            }
+        }
+        rc = dup2(stdout_fd, STDOUT_FILENO);
         if (rc < 0) {
-            report_posix_error(error_pipe[1], "dup2()");
+            report_posix_error(error_fd, "dup2()");
             abort();
         }
         if (!stderr_) {
             int fd = open("/dev/null", O_WRONLY);
             if (fd < 0) {
-                report_posix_error(error_pipe[1], "open()");
+                report_posix_error(error_fd, "open()");
                 abort();
             }
             rc = dup2(fd, STDERR_FILENO);
             if (rc < 0) {
-                report_posix_error(error_pipe[1], "dup2()");
+                report_posix_error(error_fd, "dup2()");
                 abort();
             }
         }
-        int rc = fd_close_range(STDERR_FILENO + 1, max_fd, error_pipe[1]);
+        int rc = fd_close_range(STDERR_FILENO + 1, max_fd, error_fd);
         if (rc < 0) {
-            report_posix_error(error_pipe[1], "close()");
+            report_posix_error(error_fd, "close()");
             abort();
         }
         execvp(c_argv[0],
             const_cast<char * const *>(c_argv.data())
         );
-        report_posix_error(error_pipe[1], "\xFF");
+        report_posix_error(error_fd, "\xFF");
         abort();
     }
-    // The parent:
-    fd_close(stdin_pipe[0]);
-    fd_close(stdout_pipe[1]);
-    fd_close(error_pipe[1]);
-    char buffer[BUFSIZ];
-    struct pollfd fds[2];
-    if (stdin_)
-        fds[0].fd = stdin_pipe[1];
-    else {
-        fds[0].fd = -1;
-        fd_close(stdin_pipe[1]);
-    }
-    fds[0].events = POLLOUT;
-    fds[1].fd = stdout_pipe[0];
-    fds[1].events = POLLIN;
-    while (1) {
-        rc = poll(fds, 2, -1);
-        if (rc < 0)
-            throw_posix_error("poll()");
-        if (fds[0].revents) {
-            assert(stdin_);
-            std::streamsize rbytes = stdin_->readsome(buffer, sizeof buffer);
-            if (rbytes == 0) {
-                fd_close(stdin_pipe[1]);
-                fds[0].fd = -1;
-            } else {
-                ssize_t wbytes = write(stdin_pipe[1], buffer, rbytes);
-                if (wbytes < 0)
-                    throw_posix_error("write()");
-                stdin_->seekg(wbytes - rbytes, std::ios_base::cur);
-            }
-        }
-        if (fds[1].revents) {
-            ssize_t nbytes = read(stdout_pipe[0], buffer, sizeof buffer);
-            if (nbytes < 0)
-                throw_posix_error("read()");
-            if (nbytes == 0)
-                break;
-            if (stdout_)
-                stdout_->write(buffer, nbytes);
-        }
-    }
-    if (stdin_) {
-        std::streamsize rbytes = stdin_->readsome(buffer, 1);
-        if (rbytes > 0) {
-            // The child process terminated,
-            // even though it didn't receive the complete input.
-            errno = EPIPE;
-            throw_posix_error("write()");
-        }
-    }
-    fd_close(stdout_pipe[0]);
+    return pid;
+}
+
+// Wait for the child process, and throw an exception if it failed.
+// repr is the command, as shown in error messages.
+static void reap(pid_t pid, int error_fd, const std::string &repr, trace::Span &span, double &cpu_time)
+{
     int wait_status;
-    pid = waitpid(pid, &wait_status, 0);
+    struct rusage rusage;
+    pid = wait4(pid, &wait_status, 0, &rusage);
     if (pid < 0)
-        throw_posix_error("waitpid()");
+        throw_posix_error("wait4()");
+    cpu_time =
+        rusage.ru_utime.tv_sec + rusage.ru_utime.tv_usec / 1.0e6 +
+        rusage.ru_stime.tv_sec + rusage.ru_stime.tv_usec / 1.0e6;
+    span.args("cpu_time", cpu_time);
+    if (WIFEXITED(wait_status))
+        span.args("exit_status", WEXITSTATUS(wait_status));
+    else if (WIFSIGNALED(wait_status))
+        span.args("signal", WTERMSIG(wait_status));
     int child_errno = 0;
-    ssize_t nbytes = read(error_pipe[0], &child_errno, sizeof child_errno);
+    ssize_t nbytes = read(error_fd, &child_errno, sizeof child_errno);
     if (nbytes < 0)
         throw_posix_error("read()");
     if (nbytes > 0 && static_cast<size_t>(nbytes) < sizeof child_errno) {
@@ -319,13 +303,13 @@ void Command::call(std::istream *stdin_, std::ostream *stdout_, bool stderr_)
     if (child_errno > 0) {
         char child_error_reason[BUFSIZ];
         ssize_t nbytes = read(
-            error_pipe[0],
+            error_fd,
             child_error_reason,
             (sizeof child_error_reason) - 1
         );
         if (nbytes < 0)
             throw_posix_error("read()");
-        fd_close(error_pipe[0]);
+        fd_close(error_fd);
         child_error_reason[nbytes] = '\0';
         errno = child_errno;
         if (child_error_reason[0] != '\xFF')
@@ -333,21 +317,21 @@ void Command::call(std::istream *stdin_, std::ostream *stdout_, bool stderr_)
         std::string child_error = POSIXError::error_message("");
         std::string message = string_printf(
             _("External command \"%s\" failed: %s"),
-            this->repr().c_str(),
+            repr.c_str(),
             child_error.c_str()
         );
-        throw CommandFailed(message);
+        throw Command::CommandFailed(message);
     }
-    fd_close(error_pipe[0]);
+    fd_close(error_fd);
     if (WIFEXITED(wait_status)) {
         unsigned long exit_status = WEXITSTATUS(wait_status);
         if (exit_status != 0) {
             std::string message = string_printf(
                 _("External command \"%s\" failed with exit status %lu"),
-                this->repr().c_str(),
+                repr.c_str(),
                 exit_status
             );
-            throw CommandFailed(message);
+            throw Command::CommandFailed(message);
         }
     } else if (WIFSIGNALED(wait_status)) {
         int sig = WTERMSIG(wait_status);
@@ -358,16 +342,16 @@ void Command::call(std::istream *stdin_, std::ostream *stdout_, bool stderr_)
                 // L10N: the latter argument is an untranslated signal name
                 // (such as "SIGSEGV")
                 _("External command \"%s\" was terminated by %s"),
-                this->repr().c_str(),
+                repr.c_str(),
                 signame
             );
         else
             message = string_printf(
                 _("External command \"%s\" was terminated by signal %d"),
-                this->repr().c_str(),
+                repr.c_str(),
                 sig
             );
-        throw CommandFailed(message);
+        throw Command::CommandFailed(message);
     } else {
         // should not happen
         errno = EINVAL;
@@ -375,6 +359,260 @@ void Command::call(std::istream *stdin_, std::ostream *stdout_, bool stderr_)
     }
 }
 
+void Command::call(std::istream *stdin_, std::ostream *stdout_, bool stderr_)
+{
+    std::string dir_name, base_name;
+    split_path(this->command, dir_name, base_name);
+    trace::Span span("command", base_name);
+    if (trace::is_enabled())
+        span.args("argv", join_argv(this->argv));
+    int rc;
+    int stdout_pipe[2];
+    int stdin_pipe[2];
+    int error_pipe[2];
+    size_t argc = this->argv.size();
+    std::vector<const char *> c_argv(argc + 1);
+    for (size_t i = 0; i < argc; i++)
+        c_argv[i] = argv[i].c_str();
+    c_argv[argc] = nullptr;
+    assert(c_argv[0] != nullptr);
+    mkfifo(stdout_pipe);
+    mkfifo(stdin_pipe, O_NONBLOCK);
+    mkfifo(error_pipe);
+    pid_t pid = spawn(c_argv, stdin_pipe[0], stdout_pipe[1], error_pipe[1], stderr_);
+    // The parent:
+    span.args("pid", static_cast<long long>(pid));
+    fd_close(stdin_pipe[0]);
+    fd_close(stdout_pipe[1]);
+    fd_close(error_pipe[1]);
+    char buffer[BUFSIZ];
+    struct pollfd fds[2];
+    if (stdin_)
+        fds[0].fd = stdin_pipe[1];
+    else {
+        fds[0].fd = -1;
+        fd_close(stdin_pipe[1]);
+    }
+    fds[0].events = POLLOUT;
+    fds[1].fd = stdout_pipe[0];
+    fds[1].events = POLLIN;
+    trace::clock::duration poll_time = trace::clock::duration::zero();
+    while (1) {
+        trace::clock::time_point poll_start = trace::clock::now();
+        rc = poll(fds, 2, -1);
+        poll_time += trace::clock::now() - poll_start;
+        if (rc < 0)
+            throw_posix_error("poll()");
+        if (fds[0].revents) {
+            assert(stdin_);
+            std::streamsize rbytes = stdin_->readsome(buffer, sizeof buffer);
+            if (rbytes == 0) {
+                fd_close(stdin_pipe[1]);
+                fds[0].fd = -1;
+            } else {
+                ssize_t wbytes = write(stdin_pipe[1], buffer, rbytes);
+                if (wbytes < 0)
+                    throw_posix_error("write()");
+                stdin_->seekg(wbytes - rbytes, std::ios_base::cur);
+            }
+        }
+        if (fds[1].revents) {
+            ssize_t nbytes = read(stdout_pipe[0], buffer, sizeof buffer);
+            if (nbytes < 0)
+                throw_posix_error("read()");
+            if (nbytes == 0)
+                break;
+            if (stdout_)
+                stdout_->write(buffer, nbytes);
+        }
+    }
+    if (stdin_) {
+        std::streamsize rbytes = stdin_->readsome(buffer, 1);
+        if (rbytes > 0) {
+            // The child process terminated,
+            // even though it didn't receive the complete input.
+            errno = EPIPE;
+            throw_posix_error("write()");
+        }
+    }
+    fd_close(stdout_pipe[0]);
+    span.args("poll_time", std::chrono::duration<double>(poll_time).count());
+    reap(pid, error_pipe[0], this->repr(), span, this->cpu_time);
+}
+
+// Write to a pipe. If the reader has gone away, fail with EPIPE,
+// rather than let SIGPIPE kill the whole process.
+static ssize_t write_to_pipe(int fd, const char *data, size_t size)
+{
+    sigset_t sigpipe_set, old_set;
+    sigemptyset(&sigpipe_set);
+    sigaddset(&sigpipe_set, SIGPIPE);
+    int rc = pthread_sigmask(SIG_BLOCK, &sigpipe_set, &old_set);
+    if (rc != 0) {
+        errno = rc;
+        throw_posix_error("pthread_sigmask()");
+    }
+    ssize_t nbytes = write(fd, data, size);
+    if (nbytes < 0 && errno == EPIPE && !sigismember(&old_set, SIGPIPE)) {
+        // Discard the signal that is now pending for this thread:
+        sigset_t pending_set;
+        int sig;
+        if (sigpending(&pending_set) == 0 && sigismember(&pending_set, SIGPIPE))
+            sigwait(&sigpipe_set, &sig);
+        errno = EPIPE;
+    }
+    int errno_copy = errno;
+    pthread_sigmask(SIG_SETMASK, &old_set, nullptr);
+    errno = errno_copy;
+    return nbytes;
+}
+
+// Output stream buffer that writes to a pipe.
+// Errors are not reported through the stream, but by get_error(),
+// so that the caller can find out why the reader has gone away first.
+class PipeBuffer : public std::streambuf
+{
+protected:
+    int fd;
+    int error;
+    char buffer[1 << 16];
+
+    bool flush_buffer()
+    {
+        const char *p = this->pbase();
+        while (p < this->pptr() && this->error == 0) {
+            ssize_t nbytes = write_to_pipe(this->fd, p, this->pptr() - p);
+            if (nbytes < 0) {
+                if (errno != EINTR)
+                    this->error = errno;
+            } else
+                p += nbytes;
+        }
+        this->setp(this->buffer, this->buffer + sizeof this->buffer);
+        return this->error == 0;
+    }
+
+    int_type overflow(int_type c)
+    {
+        if (!this->flush_buffer())
+            return traits_type::eof();
+        if (!traits_type::eq_int_type(c, traits_type::eof()))
+            this->sputc(traits_type::to_char_type(c));
+        return traits_type::not_eof(c);
+    }
+
+    int sync()
+    {
+        return this->flush_buffer() ? 0 : -1;
+    }
+
+public:
+    explicit PipeBuffer(int fd)
+    : fd(fd),
+      error(0)
+    {
+        this->setp(this->buffer, this->buffer + sizeof this->buffer);
+    }
+
+    ~PipeBuffer()
+    {
+        if (this->fd >= 0)
+            close(this->fd);
+    }
+
+    // Write out the buffer and close the pipe;
+    // return errno of the first failed write, or 0.
+    int close_pipe()
+    {
+        this->flush_buffer();
+        fd_close(this->fd);
+        this->fd = -1;
+        return this->error;
+    }
+};
+
+class PipeStream : public std::ostream
+{
+public:
+    PipeBuffer buffer;
+    explicit PipeStream(int fd)
+    : std::ostream(nullptr),
+      buffer(fd)
+    {
+        this->rdbuf(&this->buffer);
+    }
+};
+
+std::ostream &Command::start(bool quiet)
+{
+    assert(this->pid < 0);
+    std::string dir_name, base_name;
+    split_path(this->command, dir_name, base_name);
+    trace::Span span("command", base_name);
+    if (trace::is_enabled())
+        span.args("argv", join_argv(this->argv));
+    int stdin_pipe[2];
+    int error_pipe[2];
+    size_t argc = this->argv.size();
+    std::vector<const char *> c_argv(argc + 1);
+    for (size_t i = 0; i < argc; i++)
+        c_argv[i] = argv[i].c_str();
+    c_argv[argc] = nullptr;
+    assert(c_argv[0] != nullptr);
+    mkfifo(stdin_pipe);
+    mkfifo(error_pipe);
+    pid_t pid = spawn(c_argv, stdin_pipe[0], -1, error_pipe[1], !quiet);
+    // The parent:
+    span.args("pid", static_cast<long long>(pid));
+    fd_close(stdin_pipe[0]);
+    fd_close(error_pipe[1]);
+    this->pid = pid;
+    this->error_fd = error_pipe[0];
+    this->stdin_stream.reset(new PipeStream(stdin_pipe[1]));
+    return *this->stdin_stream;
+}
+
+void Command::close_input()
+{
+    if (!this->stdin_stream)
+        return;
+    PipeStream &stream = static_cast<PipeStream &>(*this->stdin_stream);
+    this->stdin_errno = stream.buffer.close_pipe();
+    this->stdin_stream.reset();
+}
+
+void Command::wait()
+{
+    assert(this->pid >= 0);
+    std::string dir_name, base_name;
+    split_path(this->command, dir_name, base_name);
+    trace::Span span("command", base_name);
+    span.args("pid", static_cast<long long>(this->pid));
+    this->close_input();
+    pid_t pid = this->pid;
+    int error_fd = this->error_fd;
+    this->pid = -1;
+    this->error_fd = -1;
+    reap(pid, error_fd, this->repr(), span, this->cpu_time);
+    if (this->stdin_errno != 0) {
+        // The child process terminated successfully,
+        // even though it didn't receive the complete input.
+        errno = this->stdin_errno;
+        throw_posix_error("write()");
+    }
+}
+
+Command::~Command()
+{
+    if (this->pid < 0)
+        return;
+    // The input is incomplete; don't let the child process act on it:
+    kill(this->pid, SIGTERM);
+    this->stdin_stream.reset();
+    waitpid(this->pid, nullptr, 0);
+    close(this->error_fd);
+}
+
 std::string Command::filter(const std::string &command_line, const std::string &string)
 {
     std::istringstream stdin_(string);
@@ -24,8 +24,11 @@
 
 #include "i18n.hh"
 #include "string-printf.hh"
+#include "trace.hh"
 
-Command::Command(const std::string& command) : command(command)
+Command::Command(const std::string& command)
+: command(command),
+  cpu_time(0)
 {
     // Convert path separators:
     std::ostringstream stream;
@@ -124,6 +127,11 @@ std::string Command::repr()
 void Command::call(std::istream *stdin_, std::ostream *stdout_, bool stderr_)
 {
     assert(stdin_ == nullptr); // stdin support not implemented yet
+    std::string dir_name, base_name;
+    split_path(this->command, dir_name, base_name);
+    trace::Span span("command", base_name);
+    if (trace::is_enabled())
+        span.args("argv", argv_to_command_line(this->argv));
     int status = 0;
     unsigned long rc;
     PROCESS_INFORMATION process_info;
@@ -208,6 +216,18 @@ void Command::call(std::istream *stdin_, std::ostream *stdout_, bool stderr_)
         if (rc == WAIT_FAILED)
             throw_win32_error("WaitForSingleObject");
         rc = GetExitCodeProcess(process_info.hProcess, &exit_code);
+        FILETIME creation_time, exit_time, kernel_time, user_time;
+        if (GetProcessTimes(process_info.hProcess, &creation_time, &exit_time, &kernel_time, &user_time)) {
+            ULARGE_INTEGER kernel_100ns, user_100ns;
+            kernel_100ns.LowPart = kernel_time.dwLowDateTime;
+            kernel_100ns.HighPart = kernel_time.dwHighDateTime;
+            user_100ns.LowPart = user_time.dwLowDateTime;
+            user_100ns.HighPart = user_time.dwHighDateTime;
+            this->cpu_time = (kernel_100ns.QuadPart + user_100ns.QuadPart) / 1.0e7;
+        }
+        span.args("cpu_time", this->cpu_time);
+        if (rc != 0)
+            span.args("exit_status", static_cast<long long>(exit_code));
         CloseHandle(process_info.hProcess); // ignore errors
         CloseHandle(process_info.hThread); // ignore errors
         if (rc == 0)
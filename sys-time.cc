@@ -13,13 +13,16 @@
  */
 
 #include "autoconf.hh"
-
-#if !HAVE_TIMEGM
-
 #include "sys-time.hh"
 
 #include <cerrno>
 
+#if WIN32
+#include <windows.h>
+#endif
+
+#if !HAVE_TIMEGM
+
 time_t timegm(struct tm *tm)
 {
     time_t y = tm->tm_year + 1900;
@@ -36,3 +39,30 @@ time_t timegm(struct tm *tm)
 }
 
 #endif
+
+#if WIN32
+
+double get_thread_cpu_time()
+{
+    FILETIME creation_time, exit_time, kernel_time, user_time;
+    if (!GetThreadTimes(GetCurrentThread(), &creation_time, &exit_time, &kernel_time, &user_time))
+        return 0;
+    ULARGE_INTEGER kernel_100ns, user_100ns;
+    kernel_100ns.LowPart = kernel_time.dwLowDateTime;
+    kernel_100ns.HighPart = kernel_time.dwHighDateTime;
+    user_100ns.LowPart = user_time.dwLowDateTime;
+    user_100ns.HighPart = user_time.dwHighDateTime;
+    return (kernel_100ns.QuadPart + user_100ns.QuadPart) / 1.0e7;
+}
+
+#else
+
+double get_thread_cpu_time()
+{
+    struct timespec ts;
+    if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) != 0)
+        return 0;
+    return ts.tv_sec + ts.tv_nsec / 1.0e9;
+}
+
+#endif
@@ -21,6 +21,9 @@
 time_t timegm(struct tm *tm);
 #endif
 
+/* CPU time consumed so far by the calling thread, in seconds: */
+double get_thread_cpu_time();
+
 #endif
 
 // vim:ts=2 sts=2 sw=2 et
@@ -28,14 +28,21 @@
 #include <stdexcept>
 #include <vector>
 
+#if HAVE_MEMFD_CREATE
+#include <mutex>
+#include <set>
+#endif
+
 #include <dirent.h>
+#include <fcntl.h>
 #include <libgen.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
 #if WIN32
-#include <fcntl.h>
 #include <windows.h>
+#else
+#include <sys/mman.h>
 #endif
 
 #include "debug.hh"
@@ -419,8 +426,104 @@ std::ostream &operator<<(std::ostream &out, const File &file)
  * ==========================
  */
 
+static uintmax_t temporary_memory_limit = 0;
+
+#if HAVE_MEMFD_CREATE
+
+/* Descriptors of all the in-memory temporary files: */
+static std::set<int> memory_files;
+static std::mutex memory_files_mutex;
+/* Total size of the in-memory files when they were last measured,
+ * and the number of files created since then: */
+static uintmax_t memory_files_size = 0;
+static size_t n_new_memory_files = 0;
+
+/* Measuring all the files takes one fstat() per file, so it's done only
+ * after their number has grown by an eighth. In the meantime, new files
+ * are assumed to be as big as the average of the measured ones.
+ */
+static uintmax_t get_memory_files_size()
+{
+  const size_t n_files = memory_files.size();
+  if (n_new_memory_files * 8 >= n_files)
+  {
+    memory_files_size = 0;
+    for (int fd : memory_files)
+    {
+      struct stat st;
+      if (fstat(fd, &st) == 0)
+        memory_files_size += st.st_size;
+    }
+    n_new_memory_files = 0;
+    return memory_files_size;
+  }
+  const size_t n_old_files = n_files - n_new_memory_files;
+  return memory_files_size + memory_files_size / n_old_files * n_new_memory_files;
+}
+
+static int close_memory_file(int fd)
+{
+  /* Forget the descriptor before closing it, so that it's not confused
+   * with a new file that gets the same number: */
+  std::lock_guard<std::mutex> lock(memory_files_mutex);
+  memory_files.erase(fd);
+  return ::close(fd);
+}
+
+#endif
+
+void TemporaryFile::set_memory_limit(uintmax_t limit)
+{
+  temporary_memory_limit = limit;
+}
+
+/* Create the file with memfd_create(), unless in-memory files already take
+ * too much memory. The limit is not enforced afterwards. Child processes can open the file by its /proc path.
+ * Return false if the file should be created on disk instead.
+ */
+bool TemporaryFile::construct_in_memory()
+{
+#if HAVE_MEMFD_CREATE
+  if (temporary_memory_limit == 0)
+    return false;
+  int fd;
+  {
+    std::lock_guard<std::mutex> lock(memory_files_mutex);
+    if (get_memory_files_size() >= temporary_memory_limit)
+      return false;
+    fd = memfd_create(PACKAGE_NAME, MFD_CLOEXEC);
+    if (fd == -1)
+      /* Most likely, the kernel is too old. */
+      return false;
+    memory_files.insert(fd);
+    n_new_memory_files++;
+  }
+  std::string path = string_printf("/proc/%ld/fd/%d", static_cast<long>(getpid()), fd);
+  if (access(path.c_str(), R_OK | W_OK) == -1)
+  { /* Most likely, /proc is not mounted. */
+    close_memory_file(fd);
+    return false;
+  }
+  try
+  {
+    this->open(path, File::trunc);
+  }
+  catch (...)
+  {
+    close_memory_file(fd);
+    throw;
+  }
+  this->memfd = fd;
+  return true;
+#else
+  return false;
+#endif
+}
+
 void TemporaryFile::construct()
 {
+  if (this->construct_in_memory())
+    return;
 #if !WIN32
   TemporaryPathTemplate path_buffer;
   int fd = mkstemp(path_buffer);
@@ -440,6 +543,7 @@ void TemporaryFile::construct()
 }
 
 TemporaryFile::TemporaryFile()
+: memfd(-1)
 {
   this->construct();
 }
@@ -448,6 +552,14 @@ TemporaryFile::~TemporaryFile()
 {
   if (this->is_open())
     this->close();
+#if HAVE_MEMFD_CREATE
+  if (this->memfd != -1)
+  {
+    if (close_memory_file(this->memfd) == -1)
+      warn_posix_error(this->name);
+    return;
+  }
+#endif
   if (unlink(this->name.c_str()) == -1)
     warn_posix_error(this->name);
 }
@@ -462,6 +574,83 @@ File::openmode ExistingFile::get_default_open_mode()
   return File::openmode();
 }
 
+
+/* class MappedFile
+ * ================
+ */
+
+MappedFile::MappedFile(const std::string &path)
+: data(nullptr), size(0)
+{
+#if WIN32
+  int fd = ::open(path.c_str(), O_RDONLY | O_BINARY);
+#else
+  int fd = ::open(path.c_str(), O_RDONLY);
+#endif
+  if (fd == -1)
+    throw_posix_error(path);
+  struct stat st;
+  int rc = fstat(fd, &st);
+  if (rc == 0 && !S_ISREG(st.st_mode))
+  {
+    errno = EINVAL;
+    rc = -1;
+  }
+  if (rc == 0 && st.st_size > 0)
+  {
+    this->size = st.st_size;
+#if !WIN32
+    void *ptr = mmap(nullptr, this->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (ptr == MAP_FAILED)
+      rc = -1;
+    else
+      this->data = static_cast<char*>(ptr);
+#else
+    this->data = new char[this->size];
+    for (size_t offset = 0; rc == 0 && offset < this->size; )
+    {
+      ssize_t n = ::read(fd, this->data + offset, this->size - offset);
+      if (n > 0)
+        offset += n;
+      else
+      {
+        if (n == 0)
+          errno = EIO;
+        rc = -1;
+      }
+    }
+#endif
+  }
+  if (rc == -1)
+  {
+    int saved_errno = errno;
+    ::close(fd);
+    this->release();
+    errno = saved_errno;
+    throw_posix_error(path);
+  }
+  if (::close(fd) == -1)
+    warn_posix_error(path);
+}
+
+MappedFile::~MappedFile()
+{
+  this->release();
+}
+
+void MappedFile::release()
+{
+  if (this->data == nullptr)
+    return;
+#if !WIN32
+  if (munmap(this->data, this->size) == -1)
+    warn_posix_error("munmap()");
+#else
+  delete[] this->data;
+#endif
+  this->data = nullptr;
+}
+
 #if WIN32
 
 /* class ProgramDir
@@ -490,15 +679,17 @@ ProgramDir::ProgramDir()
  * =================
  */
 
+static const std::streamsize copy_buffer_size = 1 << 16;
+
 void copy_stream(std::istream &istream, std::ostream &ostream, bool seek)
 {
   if (seek)
     istream.seekg(0, std::ios::beg);
-  char buffer[BUFSIZ];
+  std::vector<char> buffer(copy_buffer_size);
   while (!istream.eof())
   {
-    istream.read(buffer, sizeof buffer);
-    ostream.write(buffer, istream.gcount());
+    istream.read(buffer.data(), copy_buffer_size);
+    ostream.write(buffer.data(), istream.gcount());
   }
 }
 
@@ -506,12 +697,12 @@ void copy_stream(std::istream &istream, std::ostream &ostream, bool seek, std::s
 {
   if (seek)
     istream.seekg(0, std::ios::beg);
-  char buffer[BUFSIZ];
+  std::vector<char> buffer(copy_buffer_size);
   while (!istream.eof() && limit > 0)
   {
-    std::streamsize chunk_size = std::min(static_cast<std::streamsize>(sizeof buffer), limit);
-    istream.read(buffer, chunk_size);
-    ostream.write(buffer, istream.gcount());
+    std::streamsize chunk_size = std::min(copy_buffer_size, limit);
+    istream.read(buffer.data(), chunk_size);
+    ostream.write(buffer.data(), istream.gcount());
     limit -= chunk_size;
   }
 }
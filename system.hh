@@ -16,8 +16,10 @@
 #define PDF2DJVU_SYSTEM_HH
 
 #include <cstddef>
+#include <cstdint>
 #include <fstream>
 #include <iostream>
+#include <memory>
 #include <stdexcept>
 #include <string>
 #include <vector>
@@ -69,8 +71,18 @@ class Command
 protected:
   std::string command;
   std::vector<std::string> argv;
+  /* User + system CPU time of the last child process, in seconds: */
+  double cpu_time;
   std::string repr();
   void call(std::istream *stdin_, std::ostream *stdout_, bool stderr_);
+#if !WIN32
+  /* The child process started by start(), or -1: */
+  int pid;
+  int error_fd;
+  std::unique_ptr<std::ostream> stdin_stream;
+  /* errno of the first failed write to stdin_stream, or 0: */
+  int stdin_errno;
+#endif
 public:
   class CommandFailed : public std::runtime_error
   {
@@ -87,11 +99,29 @@ public:
   {
     this->call(nullptr, &stdout_, !quiet);
   }
+  void operator()(std::istream &stdin_, std::ostream &stdout_, bool quiet=false)
+  {
+    this->call(&stdin_, &stdout_, !quiet);
+  }
   void operator()(bool quiet=false)
   {
     this->call(nullptr, nullptr, !quiet);
   }
+  double get_cpu_time() const
+  {
+    return this->cpu_time;
+  }
   static std::string filter(const std::string &command_line, const std::string &string);
+#if !WIN32
+  /* Run the command in the background, with standard output discarded.
+   * Return a stream connected to its standard input; the caller should
+   * write the whole input, then call close_input() and eventually wait().
+   */
+  std::ostream &start(bool quiet=false);
+  void close_input();
+  void wait();
+  ~Command();
+#endif
 };
 
 class Directory
@@ -150,16 +180,27 @@ private:
   TemporaryFile(const TemporaryFile &) = delete;
   TemporaryFile& operator=(const TemporaryFile &) = delete;
 protected:
+  /* Descriptor of the in-memory file, or -1 if the file is on disk: */
+  int memfd;
   void construct();
+  bool construct_in_memory();
 public:
   TemporaryFile(const Directory& directory, const std::string &name)
-  : File(directory, name)
+  : File(directory, name),
+    memfd(-1)
   { }
   explicit TemporaryFile(const std::string &name)
-  : File(name)
+  : File(name),
+    memfd(-1)
   { }
   TemporaryFile();
   virtual ~TemporaryFile();
+  /* Create anonymous temporary files in memory, as long as in-memory files
+   * take less than about limit bytes in total at that time. Files that are
+   * already in memory stay there, even if they grow past the limit.
+   * Zero disables in-memory files.
+   */
+  static void set_memory_limit(uintmax_t limit);
 };
 
 class ExistingFile : public File
@@ -180,6 +221,31 @@ public:
   { }
 };
 
+/* Read-only view of a whole file.
+ * On POSIX systems, the file is memory-mapped; elsewhere, it is read into memory.
+ */
+class MappedFile
+{
+private:
+  MappedFile(const MappedFile &) = delete;
+  MappedFile& operator=(const MappedFile &) = delete;
+protected:
+  char *data;
+  size_t size;
+  void release();
+public:
+  explicit MappedFile(const std::string &path);
+  ~MappedFile();
+  const char *get_data() const
+  {
+    return this->data;
+  }
+  size_t get_size() const
+  {
+    return this->size;
+  }
+};
+
 #if WIN32
 
 class ProgramDir
@@ -0,0 +1,54 @@
+# encoding=UTF-8
+
+# Copyright © 2026 Jakub Wilk <jwilk@jwilk.net>
+#
+# This file is part of pdf2djvu.
+#
+# pdf2djvu is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License version 2 as
+# published by the Free Software Foundation.
+#
+# pdf2djvu is distributed in the hope that it will be useful, but
+# WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# General Public License for more details.
+
+from tools import (
+    assert_equal,
+    case,
+)
+
+class test(case):
+
+    def convert(self, *args):
+        self.pdf2djvu('--dpi=72', *args).assert_()
+        images = [self.decode(page=n) for n in (1, 2)]
+        r = self.print_text()
+        r.assert_(stdout=None)
+        text = r.stdout
+        r = self.print_ant(1)
+        r.assert_(stdout=None)
+        ant = r.stdout
+        # Layers and their sizes, i.e. whether the page has a background
+        # and how the foreground was quantized:
+        r = self.djvudump()
+        r.assert_(stdout=None)
+        dump = r.stdout
+        return images, text, ant, dump
+
+    def _test(self, *args):
+        expected = self.convert(*args)
+        for band_height in '1', '7', '72', '100':
+            result = self.convert('--band-height=' + band_height, *args)
+            assert_equal(result, expected)
+
+    def test(self):
+        self._test()
+
+    def test_web(self):
+        self._test('--fg-colors=web')
+
+    def test_black(self):
+        self._test('--fg-colors=black')
+
+# vim:ts=4 sts=4 sw=4 et
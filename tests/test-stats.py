@@ -0,0 +1,57 @@
+# encoding=UTF-8
+
+# Copyright © 2026 Jakub Wilk <jwilk@jwilk.net>
+#
+# This file is part of pdf2djvu.
+#
+# pdf2djvu is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License version 2 as
+# published by the Free Software Foundation.
+#
+# pdf2djvu is distributed in the hope that it will be useful, but
+# WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# General Public License for more details.
+
+import json
+import os
+import shutil
+import tempfile
+
+from tools import (
+    assert_equal,
+    assert_greater,
+    assert_in,
+    case,
+)
+
+class test(case):
+
+    def _test(self, *args):
+        tmpdir = tempfile.mkdtemp(prefix='pdf2djvu.test.')
+        try:
+            stats_path = os.path.join(tmpdir, 'stats.json')
+            self.pdf2djvu('--stats', stats_path, *args).assert_()
+            with open(stats_path) as file:
+                stats = [json.loads(line) for line in file]
+        finally:
+            shutil.rmtree(tmpdir)
+        assert_equal(sorted(s['page'] for s in stats), [1, 2])
+        for s in stats:
+            assert_equal(s['file'], self.get_pdf_path())
+            assert_equal(s['dpi'], 300)
+            assert_greater(s['width'], 0)
+            assert_greater(s['height'], 0)
+            assert_greater(s['peak_bitmap_bytes'], 0)
+            assert_in('render-1', s['stages'])
+            assert_in('csepdjvu', s['stages'])
+            assert_in('INFO', s['chunks'])
+            assert_in('Sjbz', s['chunks'])
+
+    def test(self):
+        self._test()
+
+    def test_jobs(self):
+        self._test('-j2')
+
+# vim:ts=4 sts=4 sw=4 et
@@ -0,0 +1,31 @@
+# encoding=UTF-8
+
+# Copyright © 2026 Jakub Wilk <jwilk@jwilk.net>
+#
+# This file is part of pdf2djvu.
+#
+# pdf2djvu is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License version 2 as
+# published by the Free Software Foundation.
+#
+# pdf2djvu is distributed in the hope that it will be useful, but
+# WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+
+from tools import (
+    assert_equal,
+    case,
+)
+
+class test(case):
+
+    def test(self):
+        # Metadata could include random UUIDs.
+        r = self._pdf2djvu('--no-metadata')
+        r.assert_(stdout=None)
+        self.pdf2djvu('--no-metadata').assert_()
+        with open(self.get_djvu_path(), 'rb') as file:
+            expected = file.read()
+        assert_equal(r.stdout, expected)
+
+# vim:ts=4 sts=4 sw=4 et
@@ -37,4 +37,14 @@ class test(case):
         r = self.djvudump()
         r.assert_(stdout=re.compile('BG44.* 9x9$', re.M))
 
+    def test_11_rerender(self):
+        self.pdf2djvu('--bg-subsample=11', '--bg-rerender', '--dpi=72').assert_()
+        r = self.djvudump()
+        r.assert_(stdout=re.compile('BG44.* 10x11$', re.M))
+
+    def test_12_rerender(self):
+        self.pdf2djvu('--bg-subsample=12', '--bg-rerender', '--dpi=72').assert_()
+        r = self.djvudump()
+        r.assert_(stdout=re.compile('BG44.* 9x9$', re.M))
+
 # vim:ts=4 sts=4 sw=4 et
@@ -0,0 +1,40 @@
+# encoding=UTF-8
+
+# Copyright © 2026 Jakub Wilk <jwilk@jwilk.net>
+#
+# This file is part of pdf2djvu.
+#
+# pdf2djvu is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License version 2 as
+# published by the Free Software Foundation.
+#
+# pdf2djvu is distributed in the hope that it will be useful, but
+# WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# General Public License for more details.
+
+from tools import (
+    assert_equal,
+    case,
+)
+
+class test(case):
+
+    def convert(self, *args):
+        self.pdf2djvu('--dpi=72', *args).assert_()
+        image = self.decode()
+        r = self.print_text()
+        r.assert_(stdout=None)
+        text = r.stdout
+        r = self.print_ant(1)
+        r.assert_(stdout=None)
+        ant = r.stdout
+        return image, text, ant
+
+    def test(self):
+        expected = self.convert()
+        for temp_memory in '0', '1':
+            result = self.convert('--temp-memory=' + temp_memory)
+            assert_equal(result, expected)
+
+# vim:ts=4 sts=4 sw=4 et
@@ -0,0 +1,60 @@
+# encoding=UTF-8
+
+# Copyright © 2026 Jakub Wilk <jwilk@jwilk.net>
+#
+# This file is part of pdf2djvu.
+#
+# pdf2djvu is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License version 2 as
+# published by the Free Software Foundation.
+#
+# pdf2djvu is distributed in the hope that it will be useful, but
+# WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# General Public License for more details.
+
+import json
+import os
+import shutil
+import tempfile
+
+from tools import (
+    assert_equal,
+    assert_in,
+    case,
+)
+
+class test(case):
+
+    def _test(self, *args):
+        tmpdir = tempfile.mkdtemp(prefix='pdf2djvu.test.')
+        try:
+            trace_path = os.path.join(tmpdir, 'trace.json')
+            self.pdf2djvu('--trace', trace_path, *args).assert_()
+            with open(trace_path) as file:
+                events = json.load(file)
+        finally:
+            shutil.rmtree(tmpdir)
+        spans = [e for e in events if e['ph'] == 'X']
+        for name in 'render', 'encode':
+            pages = sorted(
+                e['args']['page'] for e in spans
+                if e['cat'] == 'page' and e['name'] == name
+            )
+            assert_equal(pages, [1, 2])
+        commands = [e for e in spans if e['cat'] == 'command']
+        assert_equal(
+            sorted(e['name'] for e in commands),
+            ['csepdjvu', 'csepdjvu']
+        )
+        for e in commands:
+            assert_in('csepdjvu', e['args']['argv'])
+            assert_equal(e['args']['exit_status'], 0)
+
+    def test(self):
+        self._test()
+
+    def test_jobs(self):
+        self._test('-j2')
+
+# vim:ts=4 sts=4 sw=4 et
@@ -222,8 +222,10 @@ class case(object):
     def ls(self):
         return self.djvused('ls', encoding='UTF-8')
 
-    def decode(self, mode='color', fmt='ppm'):
+    def decode(self, mode='color', fmt='ppm', page=None):
         args = []
+        if page is not None:
+            args += ['-page={p}'.format(p=page)]
         r = self.run(
             'ddjvu',
             self.get_djvu_path(),
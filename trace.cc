@@ -0,0 +1,133 @@
+/* Copyright © 2026 Jakub Wilk <jwilk@jwilk.net>
+ *
+ * This file is part of pdf2djvu.
+ *
+ * pdf2djvu is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * pdf2djvu is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+#include "trace.hh"
+
+#include <iomanip>
+#include <locale>
+#include <memory>
+#include <set>
+#include <sstream>
+
+#if _OPENMP
+#include <omp.h>
+#endif
+
+#include "string-utils.hh"
+#include "system.hh"
+
+static std::unique_ptr<File> trace_file;
+static trace::clock::time_point trace_start;
+static std::set<int> known_threads;
+
+static int get_thread_num()
+{
+#if _OPENMP
+    return omp_get_thread_num();
+#else
+    return 0;
+#endif
+}
+
+void trace::start(const std::string &path)
+{
+    trace_file.reset(new File(path));
+    trace_start = trace::clock::now();
+    *trace_file << "[";
+}
+
+void trace::stop()
+{
+    if (!trace_file)
+        return;
+    *trace_file << "\n]\n";
+    trace_file->close();
+    trace_file.reset();
+}
+
+bool trace::is_enabled()
+{
+    return static_cast<bool>(trace_file);
+}
+
+trace::Args &trace::Args::operator()(const char *key, const std::string &value)
+{
+    if (!this->json.empty())
+        this->json += ", ";
+    this->json += string::json_quote(key) + ": " + string::json_quote(value);
+    return *this;
+}
+
+trace::Args &trace::Args::operator()(const char *key, long long value)
+{
+    if (!this->json.empty())
+        this->json += ", ";
+    this->json += string::json_quote(key) + ": " + std::to_string(value);
+    return *this;
+}
+
+trace::Args &trace::Args::operator()(const char *key, double value)
+{
+    std::ostringstream stream;
+    stream.imbue(std::locale::classic());
+    stream << std::fixed << std::setprecision(6) << value;
+    if (!this->json.empty())
+        this->json += ", ";
+    this->json += string::json_quote(key) + ": " + stream.str();
+    return *this;
+}
+
+void trace::add_event(const char *category, const std::string &name, trace::clock::time_point begin, const trace::Args &args)
+{
+    if (!trace_file)
+        return;
+    trace::clock::time_point end = trace::clock::now();
+    typedef std::chrono::duration<double, std::micro> microseconds;
+    int tid = get_thread_num();
+    /* JSON numbers must not be affected by the locale: */
+    std::ostringstream event;
+    event.imbue(std::locale::classic());
+    event << std::fixed << std::setprecision(3);
+    event << "{\"ph\": \"X\", \"pid\": 1, \"tid\": " << tid;
+    event << ", \"cat\": " << string::json_quote(category);
+    event << ", \"name\": " << string::json_quote(name);
+    event << ", \"ts\": " << microseconds(begin - trace_start).count();
+    event << ", \"dur\": " << microseconds(end - begin).count();
+    event << ", \"args\": {" << args.get_json() << "}}";
+    #pragma omp critical(trace)
+    {
+        const char *sep = known_threads.empty() ? "\n" : ",\n";
+        if (known_threads.insert(tid).second)
+        {
+            *trace_file << sep
+                << "{\"ph\": \"M\", \"pid\": 1, \"tid\": " << tid
+                << ", \"name\": \"thread_name\", \"args\": {\"name\": \"thread " << tid << "\"}}";
+            sep = ",\n";
+        }
+        *trace_file << sep << event.str();
+    }
+}
+
+trace::Span::Span(const char *category, const std::string &name)
+: category(category),
+  name(name),
+  begin(trace::clock::now())
+{ }
+
+trace::Span::~Span()
+{
+    trace::add_event(this->category, this->name, this->begin, this->args);
+}
+
+// vim:ts=4 sts=4 sw=4 et
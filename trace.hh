@@ -0,0 +1,86 @@
+/* Copyright © 2026 Jakub Wilk <jwilk@jwilk.net>
+ *
+ * This file is part of pdf2djvu.
+ *
+ * pdf2djvu is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * pdf2djvu is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+#ifndef PDF2DJVU_TRACE_HH
+#define PDF2DJVU_TRACE_HH
+
+#include <chrono>
+#include <string>
+
+/* Timeline of events, as reported by --trace.
+ * The output is in the Trace Event Format, understood by
+ * chrome://tracing, Perfetto and similar viewers.
+ */
+namespace trace
+{
+
+    typedef std::chrono::steady_clock clock;
+
+    /* Start writing events to the file.
+     * This must be called before any threads are spawned.
+     */
+    void start(const std::string &path);
+
+    /* Finish writing the events and close the file: */
+    void stop();
+
+    bool is_enabled();
+
+    /* Arguments of an event, as JSON object members: */
+    class Args
+    {
+    protected:
+        std::string json;
+    public:
+        Args &operator()(const char *key, const std::string &value);
+        Args &operator()(const char *key, const char *value)
+        {
+            return (*this)(key, std::string(value));
+        }
+        Args &operator()(const char *key, long long value);
+        Args &operator()(const char *key, int value)
+        {
+            return (*this)(key, static_cast<long long>(value));
+        }
+        Args &operator()(const char *key, double value);
+        const std::string &get_json() const
+        {
+            return this->json;
+        }
+    };
+
+    /* Record an event that spans from begin to now: */
+    void add_event(const char *category, const std::string &name, clock::time_point begin, const Args &args = Args());
+
+    /* Event that spans the lifetime of the object: */
+    class Span
+    {
+    private:
+        Span(const Span &) = delete;
+        Span& operator=(const Span &) = delete;
+    protected:
+        const char *category;
+        std::string name;
+        clock::time_point begin;
+    public:
+        Args args;
+        Span(const char *category, const std::string &name);
+        ~Span();
+    };
+
+}
+
+#endif
+
+// vim:ts=4 sts=4 sw=4 et